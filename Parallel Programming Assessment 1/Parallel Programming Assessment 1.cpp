@@ -1,11 +1,33 @@
 // Parallel Programming Assessment 1.cpp : This file contains the 'main' function. Program execution begins and ends there.
 //
 //
-//This implementation of the assessment implements calculating the mean, min, max, standard deviation, bitonic sort, median, 1st and 3rd quartiles all using real values.
-//The mean and standard deviation use the code from the add kernel from the workshops. The min/max kernel using local memory to find partial min and maxes which are then used by the host.
-//The bitonic sort uses the code from the lecture to sort individual bitonic sets. This has then been improved using a three stage approach. 
-//The initial stage sets up the list into stage 0 where groups of 4 values are in a bitonic set. The next stage repeatedly launches the same kernel on increasingly larger bitonic sequences.
-//The final stage sorts the final bitonic sequence
+//This implementation of the assessment implements calculating the mean, min, max, standard deviation, sorting, median, 1st and 3rd quartiles all using real values.
+//The mean and standard deviation use the code from the add kernel from the workshops, writing one partial sum per work group which a second single work group kernel adds up.
+//Work items adding up many values keep Kahan-Babuska compensated sums and the tree reductions add pairwise, so the float sums stay accurate; -f sums in double on devices with cl_khr_fp64. The min/max kernel uses a tree reduction in local memory to find partial min and maxes, with the index of each, which are then merged by the host.
+//The bitonic sort is a full sorting network with one work item per compare and exchange. Each work group first sorts a block in local memory,
+//then every later stage launches one kernel per pass that is too long for a work group and finishes with the short passes fused in local memory.
+//The default radix sort sorts the float bits 4 at a time with per work group digit histograms, a Blelloch scan and a stable scatter, needing no padding.
+//The median and quartiles are interpolated from the values at their ranks, found by a radix select over the float bits unless a sort is requested with -s.
+//By default mean, min, max and variance come from one fused kernel that reads each value once and produces per work group partials merged on the host.
+//The dataset is memory mapped and parsed by one thread per CPU core straight into station, timestamp and temperature columns
+//A binary columnar copy is cached next to the text file so later runs only need to map it
+//The temperatures are uploaded to the device once and every kernel reads that buffer, the in place sorts work on a device to device copy
+//They are parsed straight into pinned memory, or on devices sharing host memory into the device buffer itself so nothing is copied
+//The station and time of the highest and lowest temperatures are reported from the indices found by either statistics path
+//Every command is queued without blocking and ordered only by event wait lists, so the statistics and quartile branches overlap on an out of order queue
+//and the host waits once at the end; devices without out of order queues run the same commands in order
+//With -c the file is instead parsed, uploaded and summarised a chunk at a time, triple buffered so the three stages overlap
+//Lists too large to sort on the device at once are sorted a device sized run at a time and the runs merged on the CPU, one thread per core
+//such lists are never uploaded whole, the statistics are calculated on each run as it is uploaded for the sort
+//The compiled kernels are cached next to their source, keyed by the source, build options, device and driver, so later runs skip the compiler
+//On devices preferring vectors the statistics kernels load float4/float8 vectors in a grid stride loop instead of one float per work item
+//-t times every work group size, vector width and number of vectors per work item for the statistics kernels and saves the fastest per device, which later runs pick up automatically
+//-n computes the same results on the CPU instead, one thread per core with AVX2/AVX-512 loops, as a baseline for the device
+//-b splits the statistics between the device and the CPU in proportion to their speed, measured on a probe slice every run
+//-m shards the data over every device of a platform, or of all platforms, each reducing its shard, and with -s sorts with a sample sort
+//that sorts the shards, partitions them by splitters taken from regular samples and sorts each partition on its own device
+//without -s the quartiles come from a radix select over the digit histograms of every shard added up on the host
+//-u does the same over the NUMA nodes of a CPU device, as sub-devices each holding their shard in memory first touched on their node
 //Every kernel reports the upload, kernel execution and download times for profiling
 
 #include <iostream>
@@ -13,7 +35,15 @@
 #include <sstream>
 #include <vector>
 #include "Utils.h"
+#include "DataLoader.h"
+#include "DataCache.h"
+#include "StatsAccumulator.h"
+#include "NativeStats.h"
 #include <chrono>
+#include <functional>
+#include <algorithm>
+#include <memory>
+#include <limits>
 #include <stdint.h>
 
 using namespace std;
@@ -25,500 +55,1806 @@ void print_help() {
 	cerr << "  -d : select device" << endl;
 	cerr << "  -l : list all platforms and devices" << endl;
 	cerr << "  -h : print this message" << endl;
-	cerr << "  -s : show sorted list (comes before stats)" << endl;
+	cerr << "  -s : sort and show the sorted list (comes before stats), otherwise quartiles use radix select" << endl;
 	cerr << "  -g : set work group size (default max size for device)" << endl;
+	cerr << "  -k : statistics kernels, fused (single pass, default) or split (mean, min/max and variance)" << endl;
+	cerr << "  -r : split sum reductions, sequential (addressing, default) or interleaved (original)" << endl;
+	cerr << "  -a : sort algorithm used by -s, radix (default) or bitonic" << endl;
+	cerr << "  -t : time every work group size, vector width and vectors per work item for the statistics kernels chosen by -k and -r and save the fastest to tuning.txt, used when -g and -v are not given" << endl;
+	cerr << "  -v : vector width of the statistics loads, 1, 2, 4, 8 or 16 (default the device's preferred float width)" << endl;
+	cerr << "  -o : sort runs of at most this many MB and merge them on the CPU (default whatever fits on the device)" << endl;
+	cerr << "  -c : stream the file through the device in chunks of this many MB, fused statistics only (not with -s, -b, -t, -k split, -n, -m or -u)" << endl;
+	cerr << "  -n : run natively on the CPU with one thread per core instead of OpenCL" << endl;
+	cerr << "  -b : calculate the statistics on both the device and the CPU, split by their measured speed" << endl;
+	cerr << "  -f : add up the sums of the mean and variance, fused or split, in double precision when the device supports cl_khr_fp64" << endl;
+	cerr << "  -m : shard the data over every device, of the platform chosen with -p (-m platform) or of all platforms (-m all)" << endl;
+	cerr << "  -u : split the device chosen with -p and -d into one sub-device per NUMA node and shard the data over them like -m" << endl;
 }
 
-//function to load data from provided path
-//opens and reads file line by line, splitting and storing only the temp values
-//outputs every 100,000th value as progress
-vector<float> loadData(string path) {
-	vector<float> temps;
-	ifstream reader(path);
-	string line;
-	int counter = 0;
-	//read lines
-	while (getline(reader, line)) {
-		stringstream ss(line);
-		string temp;
-		//get each token in string and stop at last
-		while (ss >> temp) {
-		}
-		//store temp as float
-		temps.push_back(stof(temp));
-		counter++;
-		if (counter % 100000 == 0)
-		{
-			cout << counter << endl;
-		}
-	}
-	return temps;
+//width of a lockstep wavefront on the device, used to unroll the tail of the sequential sum reductions
+//only AMD GPUs are trusted to run 32 lanes in lockstep (wave32 and wave64 both do), NVIDIA warps stopped
+//being implicitly synchronous with independent thread scheduling so they and CPUs keep every barrier
+//returns 0 when the tail must keep its barriers, including for work groups that are not a power of two
+size_t lockstepWidth(const cl::Device& device, size_t local_size) {
+	const size_t width = 32;
+	string vendor = device.getInfo<CL_DEVICE_VENDOR>();
+	bool amd = vendor.find("Advanced Micro Devices") != string::npos || vendor.find("AMD") != string::npos;
+	if (!amd || !(device.getInfo<CL_DEVICE_TYPE>() & CL_DEVICE_TYPE_GPU))
+		return 0;
+	if ((local_size & (local_size - 1)) != 0 || local_size < 2 * width)
+		return 0;
+	return width;
 }
 
-//main function
-int main(int argc, char** argv)
-{
-	//load data into vector
-	vector<float> temps;
-	cout << "Loading Data" << endl;
-	temps = loadData("temp_lincolnshire_datasets/temp_lincolnshire.txt");
-	cout << "Total size of dataset = " << temps.size() << endl;
+//build options for the kernels with work groups of local_size and vectors of vector_width floats on the device,
+//vector_items of them per work item and grid stride
+//the work group size of the statistics kernels is fixed at compile time so their reduction loops can be unrolled,
+//and the last reduction steps drop their barriers where the device guarantees lockstep wavefronts
+//fp64 makes the mean and variance sums of the fused and split kernels add up in double, see supportsFp64
+string buildOptions(const cl::Device& device, size_t local_size, size_t vector_width, size_t vector_items, bool fp64) {
+	string options = "-DGROUP_SIZE=" + to_string(local_size);
+	if (vector_width > 1)
+		options += " -DVECTOR_WIDTH=" + to_string(vector_width) + " -DVECTOR_ITEMS=" + to_string(vector_items);
+	if (fp64)
+		options += " -DUSE_FP64";
+	size_t wavefront = lockstepWidth(device, local_size);
+	if (wavefront)
+		options += " -DWAVEFRONT_SIZE=" + to_string(wavefront);
+	return options;
+}
 
-	
-	
+//vector width for the vectorised statistics kernels, the device's preferred float vector width rounded down to a
+//width OpenCL has (1, 2, 4, 8 or 16); 1 keeps the scalar kernels
+size_t preferredVectorWidth(const cl::Device& device) {
+	cl_uint preferred = device.getInfo<CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT>();
+	size_t width = 1;
+	while (width * 2 <= preferred && width < 16)
+		width *= 2;
+	return width;
+}
 
-	//initialise option variables
-	int platformID = 0;
-	int deviceID = 0;
-	int work_groups = 0;
-	bool show_sorted = false;
+//true if the device has double precision (cl_khr_fp64), which the sums of the mean and variance kernels can use
+bool supportsFp64(const cl::Device& device) {
+	return device.getInfo<CL_DEVICE_EXTENSIONS>().find("cl_khr_fp64") != string::npos;
+}
 
-	//check command line arguments and set options
-	for (int i = 1; i < argc; i++) {
-		if ((strcmp(argv[i], "-p") == 0) && (i < (argc - 1))) { platformID = atoi(argv[++i]); }
-		else if ((strcmp(argv[i], "-d") == 0) && (i < (argc - 1))) { deviceID = atoi(argv[++i]); }
-		else if (strcmp(argv[i], "-l") == 0) { cout << ListPlatformsDevices() << endl; }
-		else if (strcmp(argv[i], "-h") == 0) { print_help(); return 0; }
-		else if (strcmp(argv[i], "-s") == 0) { show_sorted = true; }
-		else if ((strcmp(argv[i], "-g") == 0) && (i < (argc - 1))) { work_groups = atoi(argv[++i]); }
+//vectors each work item of the vectorised grid stride kernels loads per stride when the tuner has not picked a number,
+//see FOR_VECTORS in my_kernels.cl
+const size_t DEFAULT_VECTOR_ITEMS = 4;
+
+//name of a statistics kernel, the vectorised grid stride variant when vector_width is above 1
+string vectorKernel(const string& name, size_t vector_width) {
+	return vector_width > 1 ? name + "_vec" : name;
+}
+
+//work groups one of the statistics kernels needs for n elements; each work group of the vectorised kernels
+//covers local_size * vector_width * vector_items elements, of the sequential addressing sums 2 * local_size
+//and of the rest local_size; vector_items must match the build, see buildOptions
+size_t statsGroups(const string& kernel, size_t n, size_t local_size, size_t vector_width, size_t vector_items) {
+	size_t per_group = local_size;
+	if (kernel.size() > 4 && kernel.compare(kernel.size() - 4, 4, "_vec") == 0)
+		per_group = local_size * vector_width * vector_items;
+	else if (kernel.size() > 4 && kernel.compare(kernel.size() - 4, 4, "_seq") == 0)
+		per_group = 2 * local_size;
+	return max((n + per_group - 1) / per_group, (size_t)1);
+}
+
+//the temperatures uploaded to the device once and read by every kernel through the same buffer
+//the buffer holds exactly size values, kernels are launched over whole work groups and ignore items past the end
+struct DeviceTemps {
+	cl::Buffer buffer;
+	size_t size = 0;
+	//host memory the loader parses into, see allocateTemps; host_buffer is buffer itself when zero_copy is set
+	cl::Buffer host_buffer;
+	float* host = nullptr;
+	bool zero_copy = false;
+};
+
+//allocates the device buffer for n temperatures and returns host memory for the loader to parse them into
+//devices sharing host memory get a buffer in host memory mapped for writing, so the parsed values never need
+//copying, other devices get a pinned staging buffer that stays mapped and feeds a full speed upload
+float* allocateTemps(cl::Context& context, cl::CommandQueue& queue, DeviceTemps& temps, size_t n) {
+	size_t bytes = max(n, (size_t)1) * sizeof(float);
+	temps.size = n;
+	if (temps.zero_copy) {
+		temps.buffer = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR, bytes);
+		temps.host_buffer = temps.buffer;
+		temps.host = (float*)queue.enqueueMapBuffer(temps.buffer, CL_TRUE, CL_MAP_WRITE_INVALIDATE_REGION, 0, bytes);
+	}
+	else {
+		temps.buffer = cl::Buffer(context, CL_MEM_READ_ONLY, bytes);
+		temps.host_buffer = cl::Buffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, bytes);
+		temps.host = (float*)queue.enqueueMapBuffer(temps.host_buffer, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, bytes);
 	}
+	return temps.host;
+}
 
-	try {
-		//host operations
-		//select computing devices
-		cl::Context context = GetContext(platformID, deviceID);
+//makes the temperatures of data readable by the kernels and returns the event every kernel has to wait for
+//values parsed into allocateTemps memory are unmapped in place or uploaded from the pinned staging buffer,
+//a dataset mapped from the cache is used in place by devices sharing host memory and copied into the pinned
+//staging buffer by the rest, as an upload straight from the pageable mapping runs at a fraction of the speed
+//data.temp is pointed at the host side mapping, which may move when the zero copy buffer is remapped for reading,
+//and must not be read on the host until the returned event completes
+cl::Event uploadTemps(cl::Context& context, cl::CommandQueue& queue, DeviceTemps& temps, TempDataset& data) {
+	size_t bytes = max(data.size(), (size_t)1) * sizeof(float);
+	cl::Event uploaded;
+	if (temps.zero_copy && (temps.host == nullptr || temps.host != data.temp)) {
+		temps.size = data.size();
+		temps.buffer = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, bytes, (void*)data.temp);
+		queue.enqueueMarkerWithWaitList(NULL, &uploaded);
+	}
+	else if (temps.zero_copy) {
+		//kernels cannot read a buffer mapped for writing, swapping to a read mapping moves no data
+		//the map does not block, the kernels and any host reads wait for its event instead
+		vector<cl::Event> unmapped(1);
+		queue.enqueueUnmapMemObject(temps.buffer, temps.host, NULL, &unmapped[0]);
+		temps.host = (float*)queue.enqueueMapBuffer(temps.buffer, CL_FALSE, CL_MAP_READ, 0, bytes, &unmapped, &uploaded);
+		data.temp = temps.host;
+	}
+	else {
+		if (temps.host == nullptr || temps.host != data.temp) {
+			allocateTemps(context, queue, temps, data.size());
+			memcpy(temps.host, data.temp, data.size() * sizeof(float));
+		}
+		queue.enqueueWriteBuffer(temps.buffer, CL_FALSE, 0, data.size() * sizeof(float), temps.host, NULL, &uploaded);
+	}
+	return uploaded;
+}
 
-		// get device
-		cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0]; 
+//partial statistics of one work group written by the stats_fused kernel, matches stats_t in my_kernels.cl
+//whose mean and m2 are doubles when the kernels are built with fp64, see buildOptions
+template<typename T>
+struct StatsPartialOf {
+	cl_uint count;
+	T mean;
+	T m2;
+	cl_float min;
+	cl_float max;
+	cl_int min_index;
+	cl_int max_index;
+};
+
+typedef StatsPartialOf<cl_float> StatsPartial;
+typedef StatsPartialOf<cl_double> StatsPartial64;
+
+//size of one stats_fused partial on the device
+size_t statsPartialSize(bool fp64) {
+	return fp64 ? sizeof(StatsPartial64) : sizeof(StatsPartial);
+}
 
-		//set work group size
-		size_t local_size;
-		if (work_groups > 0) {
-			local_size = work_groups;
+//host copies of the stats_fused partials, downloaded into f or, when the kernels sum in double, into d
+struct FusedPartials {
+	vector<StatsPartial> f;
+	vector<StatsPartial64> d;
+
+	//sizes the partials for groups work groups and returns where to download them
+	void* target(bool fp64, size_t groups) {
+		if (fp64) {
+			d.resize(groups);
+			return &d[0];
+		}
+		f.resize(groups);
+		return &f[0];
+	}
+
+	//merges the partials into total, offsetting their record indices by base
+	void addTo(StatsAccumulator& total, bool fp64, size_t base = 0) const {
+		if (fp64) {
+			for (const StatsPartial64& p : d)
+				total.add(p, base);
 		}
 		else {
-			//set workgroup size to max value available for the device - datasets are large so a large value is useful
-			local_size = device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+			for (const StatsPartial& p : f)
+				total.add(p, base);
 		}
-		//display the selected device
-		cout << "Runinng on " << GetPlatformName(platformID) << ", " << GetDeviceName(platformID, deviceID) << endl;
+	}
+};
+
+//partial min and max of one work group written by the maxminf kernel, matches minmax_t in my_kernels.cl
+struct MinMaxPartial {
+	cl_float min;
+	cl_float max;
+	cl_int min_index;
+	cl_int max_index;
+};
+
+//orders the commands of one branch of the pipeline on a queue that may run commands out of order
+//each command waits for the events in wait and then becomes the only event the next command waits for,
+//so a branch runs as a chain while branches started from the same events are free to overlap
+struct EventChain {
+	vector<cl::Event> wait;
+
+	EventChain() {}
+	EventChain(const vector<cl::Event>& after) : wait(after) {}
+
+	//wait list for the next command, NULL when it can start straight away
+	const vector<cl::Event>* deps() const { return wait.empty() ? NULL : &wait; }
+
+	//makes the command that signals e the one the next command waits for
+	void then(const cl::Event& e) { wait.assign(1, e); }
+};
+
+//sums the execution time of a set of profiled kernel launches
+cl_ulong kernelTime(const vector<cl::Event>& events) {
+	cl_ulong total = 0;
+	for (const cl::Event& e : events)
+		total += e.getProfilingInfo<CL_PROFILING_COMMAND_END>() - e.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+	return total;
+}
 
-		//create a queue to which we will push commands for the device
-		cl::CommandQueue queue(context, CL_QUEUE_PROFILING_ENABLE);
+//enqueues mean, min, max and variance as a single pass over the data, starting once the after events complete
+//every work group reduces its elements to a count, mean, sum of squared differences (M2), min and max,
+//using the vectorised kernel when vector_width is above 1; fp64 must match the build, see buildOptions
+//nothing blocks, the returned function prints the timings and returns the partials merged in a StatsAccumulator
+//and must only be called once the queue has finished
+function<StatsAccumulator()> fusedStats(cl::Context& context, cl::CommandQueue& queue, cl::Program& program, DeviceTemps& temps, size_t local_size, size_t vector_width, size_t vector_items, bool fp64, const vector<cl::Event>& after) {
+	//round the global size up to whole work groups, the kernel ignores items past the end of the data
+	string kernel_name = vectorKernel("stats_fused", vector_width);
+	size_t groups = statsGroups(kernel_name, temps.size, local_size, vector_width, vector_items);
+	size_t partials_size = groups * statsPartialSize(fp64);
+	//the download target has to outlive this function so it is shared with the returned function
+	shared_ptr<FusedPartials> partials = make_shared<FusedPartials>();
+	void* partials_target = partials->target(fp64, groups);
+
+	//device buffers
+	cl::Buffer buffer_partials(context, CL_MEM_READ_WRITE, partials_size);
+
+	//profiling events for the buffers and kernel
+	cl::Event prof_event;
+	cl::Event partials_download_event;
+	EventChain chain(after);
+
+	//create kernel and set arguments
+	cl::Kernel kernel_stats = cl::Kernel(program, kernel_name.c_str());
+	kernel_stats.setArg(0, temps.buffer);
+	kernel_stats.setArg(1, (cl_int)temps.size);
+	kernel_stats.setArg(2, buffer_partials);
+	kernel_stats.setArg(3, cl::Local(local_size * statsPartialSize(fp64)));//local memory size
+
+	//start the kernel
+	queue.enqueueNDRangeKernel(kernel_stats, cl::NullRange, cl::NDRange(groups * local_size), cl::NDRange(local_size), chain.deps(), &prof_event);
+	chain.then(prof_event);
+
+	//copy the partials from device to host
+	queue.enqueueReadBuffer(buffer_partials, CL_FALSE, 0, partials_size, partials_target, chain.deps(), &partials_download_event);
+
+	return [=]() {
+		cout << "Fused statistics kernel timings:" << endl;
+		cout << "\nKernel started" << endl;
+		cout << "Queued time [ns]: " << prof_event.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>() - prof_event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>() << endl;
+		cout << "Submitted time [ns]: " << prof_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() - prof_event.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>() << endl;
+		cout << "Kernal execution time [ns]:" << prof_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
+		cout << "Total kernel time [ns]: " << prof_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>() << endl;
+		cout << "\nPartials download [ns]: " << partials_download_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - partials_download_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
+		cout << "\nTotal time [ns]: " << partials_download_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
+
+		//merge the work group partials
+		StatsAccumulator merged;
+		partials->addTo(merged, fp64);
+		return merged;
+	};
+}
 
-		//load & build the device code
-		cl::Program::Sources sources;
-		AddSources(sources, "kernels/my_kernels.cl");
-		cl::Program program(context, sources);
+//result of a sum reduction, downloaded into f or, when the sums are doubles, into d
+struct SumResult {
+	cl_float f;
+	cl_double d;
 
-		//build and debug the kernel code
-		try {
-			program.build();
+	void* target(bool fp64) {
+		return fp64 ? (void*)&d : (void*)&f;
+	}
+
+	double value(bool fp64) const {
+		return fp64 ? d : f;
+	}
+};
+
+//host copies of the results of the split statistics kernels
+struct SplitResults {
+	SumResult mean;
+	SumResult m2;
+	vector<MinMaxPartial> minmax;
+};
+
+//enqueues mean, min, max and variance as separate mean, min/max and variance kernels, starting once the after
+//events complete; sequential selects the sequential addressing sum kernels instead of the original interleaved ones,
+//or the vectorised kernels when vector_width is above 1; fp64 must match the build, see buildOptions
+//the min/max branch runs alongside the mean, and the variance reads the mean straight from the device
+//nothing blocks, the returned function prints the timings and returns the count, mean, sum of squared differences
+//and min/max in a StatsAccumulator so the results of several runs merge exactly; it must only be called once the queue has finished
+function<StatsAccumulator()> splitStats(cl::Context& context, cl::CommandQueue& queue, cl::Program& program, DeviceTemps& temps, size_t local_size, bool sequential, size_t vector_width, size_t vector_items, bool fp64, const vector<cl::Event>& after) {
+	string mean_name = "meanf";
+	string minmax_name = "maxminf";
+	string var_name = "variance";
+	if (sequential) {
+		mean_name = vector_width > 1 ? "meanf_vec" : "meanf_seq";
+		minmax_name = vectorKernel(minmax_name, vector_width);
+		var_name = vector_width > 1 ? "variance_vec" : "variance_seq";
+	}
+
+	//initialise some size variables for use later when creating buffers and kernels
+	//one partial per work group, the last one may be partly empty; the mean and variance kernels always share a shape
+	size_t sum_groups = statsGroups(mean_name, temps.size, local_size, vector_width, vector_items);
+	size_t minmax_groups = statsGroups(minmax_name, temps.size, local_size, vector_width, vector_items);
+	size_t sum_size = fp64 ? sizeof(cl_double) : sizeof(cl_float);
+	size_t partials_size = sum_groups * sum_size;
+	size_t output_sizef = 1 * sum_size;
+	size_t minmax_size = minmax_groups * sizeof(MinMaxPartial);
+	//the mean is reduced with a scale of 1 / n for the variance kernel to read, the squared differences are kept as a sum
+	cl_double inv_n = 1.0 / temps.size;
+	shared_ptr<SplitResults> results = make_shared<SplitResults>();
+	results->minmax.resize(minmax_groups);
+
+	//device buffers, each branch has its own so they can run at the same time
+	cl::Buffer buffer_partials(context, CL_MEM_READ_WRITE, partials_size);
+	cl::Buffer buffer_mean(context, CL_MEM_READ_WRITE, output_sizef);
+	cl::Buffer buffer_minmax(context, CL_MEM_READ_WRITE, minmax_size);
+	cl::Buffer buffer_var_partials(context, CL_MEM_READ_WRITE, partials_size);
+	cl::Buffer buffer_m2(context, CL_MEM_READ_WRITE, output_sizef);
+
+	//profiling events for the buffers and kernels
+	cl::Event mean_event;
+	cl::Event mean_reduce_event;
+	cl::Event mean_download_event;
+	cl::Event minmax_event;
+	cl::Event minmax_download_event;
+	cl::Event var_event;
+	cl::Event var_reduce_event;
+	cl::Event var_download_event;
+
+	//create kernels and set arguments
+	//stage 1 writes a partial sum per work group, stage 2 adds the partials up in a single work group
+	cl::Kernel kernel_mean = cl::Kernel(program, mean_name.c_str());
+	kernel_mean.setArg(0, temps.buffer);
+	kernel_mean.setArg(1, (cl_int)temps.size);
+	kernel_mean.setArg(2, buffer_partials);
+	kernel_mean.setArg(3, cl::Local(local_size * sum_size));//local memory size
+
+	cl::Kernel kernel_mean_reduce = cl::Kernel(program, "reduce_sum");
+	kernel_mean_reduce.setArg(0, buffer_partials);
+	kernel_mean_reduce.setArg(1, (cl_int)sum_groups);
+	kernel_mean_reduce.setArg(2, buffer_mean);
+	if (fp64)
+		kernel_mean_reduce.setArg(3, inv_n);
+	else
+		kernel_mean_reduce.setArg(3, (cl_float)inv_n);
+	kernel_mean_reduce.setArg(4, cl::Local(local_size * sum_size));//local memory size
+
+	cl::Kernel kernel_maxmin = cl::Kernel(program, minmax_name.c_str());
+	kernel_maxmin.setArg(0, temps.buffer);
+	kernel_maxmin.setArg(1, (cl_int)temps.size);
+	kernel_maxmin.setArg(2, buffer_minmax);
+	kernel_maxmin.setArg(3, cl::Local(local_size * sizeof(MinMaxPartial)));//local memory size
+
+	cl::Kernel kernel_var = cl::Kernel(program, var_name.c_str());
+	kernel_var.setArg(0, temps.buffer);
+	kernel_var.setArg(1, (cl_int)temps.size);
+	kernel_var.setArg(2, buffer_var_partials);
+	kernel_var.setArg(3, buffer_mean);
+	kernel_var.setArg(4, cl::Local(local_size * sum_size));//local memory size
+
+	cl::Kernel kernel_var_reduce = cl::Kernel(program, "reduce_sum");
+	kernel_var_reduce.setArg(0, buffer_var_partials);
+	kernel_var_reduce.setArg(1, (cl_int)sum_groups);
+	kernel_var_reduce.setArg(2, buffer_m2);
+	if (fp64)
+		kernel_var_reduce.setArg(3, (cl_double)1.0);
+	else
+		kernel_var_reduce.setArg(3, (cl_float)1.0f);
+	kernel_var_reduce.setArg(4, cl::Local(local_size * sum_size));//local memory size
+
+	//mean branch
+	EventChain mean_chain(after);
+	queue.enqueueNDRangeKernel(kernel_mean, cl::NullRange, cl::NDRange(sum_groups * local_size), cl::NDRange(local_size), mean_chain.deps(), &mean_event);
+	mean_chain.then(mean_event);
+	queue.enqueueNDRangeKernel(kernel_mean_reduce, cl::NullRange, cl::NDRange(local_size), cl::NDRange(local_size), mean_chain.deps(), &mean_reduce_event);
+	mean_chain.then(mean_reduce_event);
+	queue.enqueueReadBuffer(buffer_mean, CL_FALSE, 0, output_sizef, results->mean.target(fp64), mean_chain.deps(), &mean_download_event);
+
+	//min/max branch, independent of the mean
+	EventChain minmax_chain(after);
+	queue.enqueueNDRangeKernel(kernel_maxmin, cl::NullRange, cl::NDRange(minmax_groups * local_size), cl::NDRange(local_size), minmax_chain.deps(), &minmax_event);
+	minmax_chain.then(minmax_event);
+	queue.enqueueReadBuffer(buffer_minmax, CL_FALSE, 0, minmax_size, &results->minmax[0], minmax_chain.deps(), &minmax_download_event);
+
+	//variance branch, waits for the mean on the device rather than on the host
+	EventChain var_chain(vector<cl::Event>(1, mean_reduce_event));
+	queue.enqueueNDRangeKernel(kernel_var, cl::NullRange, cl::NDRange(sum_groups * local_size), cl::NDRange(local_size), var_chain.deps(), &var_event);
+	var_chain.then(var_event);
+	queue.enqueueNDRangeKernel(kernel_var_reduce, cl::NullRange, cl::NDRange(local_size), cl::NDRange(local_size), var_chain.deps(), &var_reduce_event);
+	var_chain.then(var_reduce_event);
+	queue.enqueueReadBuffer(buffer_m2, CL_FALSE, 0, output_sizef, results->m2.target(fp64), var_chain.deps(), &var_download_event);
+
+	return [=]() {
+		cout << "Average kernel timings:" << endl;
+		cout << "\nKernel started" << endl;
+		cout << "Queued time [ns]: " << mean_event.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>() - mean_event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>() << endl;
+		cout << "Submitted time [ns]: " << mean_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() - mean_event.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>() << endl;
+		cout << "Kernal execution time [ns]:" << mean_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - mean_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
+		cout << "Total kernel time [ns]: " << mean_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - mean_event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>() << endl;
+		cout << "Partial sum reduction time [ns]: " << mean_reduce_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - mean_reduce_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
+		cout << "\nOutput download [ns]: " << mean_download_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - mean_download_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
+		cout << "\nTotal time [ns]: " << mean_download_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - mean_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
+
+		cout << "\n\nMax and Min kernel timings:" << endl;
+		cout << "\nKernel started" << endl;
+		cout << "Queued time [ns]: " << minmax_event.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>() - minmax_event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>() << endl;
+		cout << "Submitted time [ns]: " << minmax_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() - minmax_event.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>() << endl;
+		cout << "Kernal execution time [ns]:" << minmax_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - minmax_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
+		cout << "Total kernel time [ns]: " << minmax_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - minmax_event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>() << endl;
+		cout << "\nMax and min download [ns]: " << minmax_download_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - minmax_download_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
+		cout << "\nTotal time [ns]: " << minmax_download_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - minmax_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
+
+		cout << "\n\nVariance squared difference kernel timings:" << endl;
+		cout << "\nKernel started" << endl;
+		cout << "Queued time [ns]: " << var_event.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>() - var_event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>() << endl;
+		cout << "Submitted time [ns]: " << var_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() - var_event.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>() << endl;
+		cout << "Kernal execution time [ns]:" << var_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - var_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
+		cout << "Total kernel time [ns]: " << var_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - var_event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>() << endl;
+		cout << "Partial sum reduction time [ns]: " << var_reduce_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - var_reduce_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
+		cout << "Variance download [ns]: " << var_download_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - var_download_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
+		cout << "\nTotal time [ns]: " << var_download_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - var_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
+
+		//calculate max and minimum value, and where they are, from partials
+		StatsAccumulator merged;
+		merged.addMoments((double)temps.size, results->mean.value(fp64), results->m2.value(fp64));
+		for (const MinMaxPartial& p : results->minmax) {
+			merged.addMin(p.min, p.min_index);
+			merged.addMax(p.max, p.max_index);
 		}
-		catch (const cl::Error& err) {
-			cout << "Build Status: " << program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << endl;
-			cout << "Build Options:\t" << program.getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << endl;
-			cout << "Build Log:\t " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << endl;
-			throw err;
+		return merged;
+	};
+}
+
+//chunks in flight in the streaming pipeline, so one can be parsed while one uploads and one is in the statistics kernel
+const size_t STREAM_SLOTS = 3;
+
+//one chunk of the streaming pipeline; the parsed records stay alive as the upload source until done completes
+//and the device buffers are reused by later chunks, growing only when a chunk holds more records
+struct StreamSlot {
+	TempDataset chunk;
+	//record index of the first record of the chunk in the whole file
+	size_t base = 0;
+	bool busy = false;
+	cl::Buffer buffer_temps;
+	size_t temps_capacity = 0;
+	cl::Buffer buffer_partials;
+	size_t partials_capacity = 0;
+	FusedPartials partials;
+	cl::Event upload_event;
+	cl::Event kernel_event;
+	cl::Event done;
+};
+
+//statistics of a streamed file, with the station and time of the min and max kept from their chunks
+struct StreamedStats {
+	Stats stats;
+	size_t records = 0;
+	string min_record;
+	string max_record;
+};
+
+//calculates mean, min, max and variance of the file at path without holding all of it in host or device memory
+//the file is parsed chunk_bytes at a time; each chunk is uploaded on transfer_queue and summarised by stats_fused on
+//compute_queue once its upload completes, so parsing the next chunk overlaps the upload and kernel of the ones before
+//the partials of every chunk are merged as its slot is reused, so the wall clock time approaches the slowest of the
+//parse, transfer and compute stages rather than their sum; fp64 must match the build, see buildOptions
+StreamedStats streamStats(cl::Context& context, cl::CommandQueue& transfer_queue, cl::CommandQueue& compute_queue, cl::Program& program, const string& path, size_t chunk_bytes, size_t local_size, size_t vector_width, size_t vector_items, bool fp64) {
+	MappedFile file(path);
+	vector<size_t> bounds = splitChunks(file.data(), file.size(), file.size() / chunk_bytes + 1);
+	size_t chunks = bounds.size() - 1;
+
+	vector<StreamSlot> slots(STREAM_SLOTS);
+	StatsAccumulator merged;
+	StreamedStats streamed;
+	vector<cl::Event> upload_events;
+	vector<cl::Event> kernel_events;
+	chrono::high_resolution_clock::duration parse_time(0);
+	auto stream_start = chrono::high_resolution_clock::now();
+
+	string kernel_name = vectorKernel("stats_fused", vector_width);
+	cl::Kernel kernel_stats = cl::Kernel(program, kernel_name.c_str());
+	kernel_stats.setArg(3, cl::Local(local_size * statsPartialSize(fp64)));//local memory size
+
+	//waits for the chunk in slot and merges its partials, chunks are retired in file order
+	auto retire = [&](StreamSlot& slot) {
+		if (!slot.busy)
+			return;
+		slot.done.wait();
+		slot.partials.addTo(merged, fp64, slot.base);
+		//the min or max only moves to this chunk if one of its records beat every earlier chunk
+		if (merged.min_index >= slot.base && merged.min_index != numeric_limits<size_t>::max())
+			streamed.min_record = describeRecord(slot.chunk, merged.min_index - slot.base);
+		if (merged.max_index >= slot.base && merged.max_index != numeric_limits<size_t>::max())
+			streamed.max_record = describeRecord(slot.chunk, merged.max_index - slot.base);
+		upload_events.push_back(slot.upload_event);
+		kernel_events.push_back(slot.kernel_event);
+		slot.busy = false;
+	};
+
+	for (size_t i = 0; i < chunks; i++) {
+		StreamSlot& slot = slots[i % STREAM_SLOTS];
+		retire(slot);
+
+		auto parse_start = chrono::high_resolution_clock::now();
+		slot.chunk = parseText(file.data() + bounds[i], bounds[i + 1] - bounds[i], path);
+		parse_time += chrono::high_resolution_clock::now() - parse_start;
+		slot.base = streamed.records;
+		streamed.records += slot.chunk.size();
+
+		size_t n = slot.chunk.size();
+		if (n == 0)
+			continue;
+		size_t groups = statsGroups(kernel_name, n, local_size, vector_width, vector_items);
+		if (n > slot.temps_capacity) {
+			slot.buffer_temps = cl::Buffer(context, CL_MEM_READ_ONLY, n * sizeof(float));
+			slot.temps_capacity = n;
 		}
+		if (groups > slot.partials_capacity) {
+			slot.buffer_partials = cl::Buffer(context, CL_MEM_READ_WRITE, groups * statsPartialSize(fp64));
+			slot.partials_capacity = groups;
+		}
+		void* partials_target = slot.partials.target(fp64, groups);
+
+		//upload on its own queue so it can overlap the kernel of the chunk before
+		transfer_queue.enqueueWriteBuffer(slot.buffer_temps, CL_FALSE, 0, n * sizeof(float), slot.chunk.temp, NULL, &slot.upload_event);
+		transfer_queue.flush();
+
+		EventChain chain(vector<cl::Event>(1, slot.upload_event));
+		kernel_stats.setArg(0, slot.buffer_temps);
+		kernel_stats.setArg(1, (cl_int)n);
+		kernel_stats.setArg(2, slot.buffer_partials);
+		compute_queue.enqueueNDRangeKernel(kernel_stats, cl::NullRange, cl::NDRange(groups * local_size), cl::NDRange(local_size), chain.deps(), &slot.kernel_event);
+		chain.then(slot.kernel_event);
+		compute_queue.enqueueReadBuffer(slot.buffer_partials, CL_FALSE, 0, groups * statsPartialSize(fp64), partials_target, chain.deps(), &slot.done);
+		compute_queue.flush();
+		slot.busy = true;
+	}
+	//the oldest chunk still in flight sits in the slot after the last one used
+	for (size_t k = 0; k < STREAM_SLOTS; k++)
+		retire(slots[(chunks + k) % STREAM_SLOTS]);
+	auto stream_end = chrono::high_resolution_clock::now();
+
+	cout << "Streamed statistics timings:" << endl;
+	cout << "Chunks: " << chunks << ", records: " << streamed.records << endl;
+	cout << "\nParse time [ms]: " << chrono::duration_cast<chrono::milliseconds>(parse_time).count() << endl;
+	cout << "Upload time [ns]: " << kernelTime(upload_events) << endl;
+	cout << "Kernel execution time [ns]: " << kernelTime(kernel_events) << endl;
+	cout << "\nTotal time [ms]: " << chrono::duration_cast<chrono::milliseconds>(stream_end - stream_start).count() << endl;
+
+	streamed.stats = merged.result();
+	return streamed;
+}
+
+//enqueues a sort of a device copy of the temperatures with a bitonic sorting network, padded with +infinity up to
+//the next power of two, starting once the after events complete
+//each work group first sorts a block of 2 * L elements in local memory, then every later stage runs its long
+//passes as one global bitonic_step launch each and fuses the passes that fit in a work group into bitonic_merge_local
+//nothing blocks, the returned function prints the timings and hands over the sorted list once the queue has finished
+function<vector<float>()> bitonicSort(cl::Context& context, cl::CommandQueue& queue, cl::Program& program, DeviceTemps& temps, size_t local_size, const vector<cl::Event>& after) {
+	//sort length must be power of 2 to work with bitonic sort
+	size_t n = 2;
+	while (n < temps.size)
+		n *= 2;
+	shared_ptr<vector<float>> sorted = make_shared<vector<float>>(temps.size);
+
+	//the local kernels work on pairs so the work group is the largest power of two within local_size and n / 2
+	size_t sort_local = 1;
+	while (sort_local * 2 <= local_size && sort_local * 2 <= n / 2)
+		sort_local *= 2;
+	size_t block = sort_local * 2;
+
+	//initialise buffer for kernels, the sort is in place so it works on its own copy of the temperatures
+	cl::Buffer buffer_sort_temps(context, CL_MEM_READ_WRITE, n * sizeof(float));
+
+	//profiling events, one per kernel launch
+	cl::Event sort_temps_copy_event;
+	cl::Event sort_temps_pad_event;
+	cl::Event sorted_download_event;
+	vector<cl::Event> step_events;
+	vector<cl::Event> local_events(1);
+	EventChain chain(after);
+
+	//copy the temperatures on the device and fill the rest with +infinity, which sorts after every temperature
+	queue.enqueueCopyBuffer(temps.buffer, buffer_sort_temps, 0, 0, temps.size * sizeof(float), chain.deps(), &sort_temps_copy_event);
+	chain.then(sort_temps_copy_event);
+	if (n > temps.size) {
+		queue.enqueueFillBuffer(buffer_sort_temps, numeric_limits<float>::infinity(), temps.size * sizeof(float), (n - temps.size) * sizeof(float), chain.deps(), &sort_temps_pad_event);
+		chain.then(sort_temps_pad_event);
+	}
 
+	//create kernels
+	cl::Kernel kernel_sort_local = cl::Kernel(program, "bitonic_sort_local");
+	kernel_sort_local.setArg(0, buffer_sort_temps);
+	kernel_sort_local.setArg(1, cl::Local(block * sizeof(float)));//local memory size
+
+	cl::Kernel kernel_step = cl::Kernel(program, "bitonic_step");
+	kernel_step.setArg(0, buffer_sort_temps);
+
+	cl::Kernel kernel_merge_local = cl::Kernel(program, "bitonic_merge_local");
+	kernel_merge_local.setArg(0, buffer_sort_temps);
+	kernel_merge_local.setArg(2, cl::Local(block * sizeof(float)));//local memory size
+
+	//all stages up to the block size, then the rest of the stages one pass or fused group of passes at a time
+	//each launch waits for the one before it, the host does not synchronise between them
+	queue.enqueueNDRangeKernel(kernel_sort_local, cl::NullRange, cl::NDRange(n / 2), cl::NDRange(sort_local), chain.deps(), &local_events[0]);
+	chain.then(local_events[0]);
+	for (size_t k = block * 2; k <= n; k *= 2) {
+		for (size_t j = k / 2; j >= block; j /= 2) {
+			kernel_step.setArg(1, (cl_int)j);
+			kernel_step.setArg(2, (cl_int)k);
+			step_events.push_back(cl::Event());
+			queue.enqueueNDRangeKernel(kernel_step, cl::NullRange, cl::NDRange(n / 2), cl::NDRange(sort_local), chain.deps(), &step_events.back());
+			chain.then(step_events.back());
+		}
+		kernel_merge_local.setArg(1, (cl_int)k);
+		local_events.push_back(cl::Event());
+		queue.enqueueNDRangeKernel(kernel_merge_local, cl::NullRange, cl::NDRange(n / 2), cl::NDRange(sort_local), chain.deps(), &local_events.back());
+		chain.then(local_events.back());
+	}
 
-		
+	//retrieve sorted vector from device, leaving the padding behind
+	queue.enqueueReadBuffer(buffer_sort_temps, CL_FALSE, 0, temps.size * sizeof(float), &(*sorted)[0], chain.deps(), &sorted_download_event);
 
-		//create a padded array so the total size is divisible by the number of workgroups
-		vector<float> padded_temps(temps.begin(), temps.end());
-		size_t padding_size = local_size - (padded_temps.size() % local_size);
-		//if the input vector is not a multiple of the local_size
-		//insert additional neutral elements (0 for addition) so that the total will not be affected
+	return [=]() {
+		cout << "\n\nBitonic sort kernel timings:" << endl;
+		cout << "Device copy [ns]: " << sort_temps_copy_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - sort_temps_copy_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
+		cout << "\nLocal memory launches: " << local_events.size() << ", execution time [ns]: " << kernelTime(local_events) << endl;
+		cout << "Global step launches: " << step_events.size() << ", execution time [ns]: " << kernelTime(step_events) << endl;
+		cout << "\nSorted download [ns]: " << sorted_download_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - sorted_download_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
+		cout << "\nTotal bitonic sort time [ns]: " << sorted_download_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - sort_temps_copy_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
 
-		if (padding_size) {
-			//create an extra vector with neutral values
-			vector<float> A_ext(padding_size, 0.0f);
-			//append that extra vector to our input
-			padded_temps.insert(padded_temps.end(), A_ext.begin(), A_ext.end());
-		}
+		return move(*sorted);
+	};
+}
 
-		//create a vector to store the output from the mean kernel
-		vector<int> output(1);
+//digit width of the radix sort passes, matches RADIX_BITS in my_kernels.cl
+const int RADIX_BITS = 4;
+
+//enqueues an exclusive prefix sum of the first n uints of buffer, in place, as the next commands of chain
+//each work group scans 2 * L elements and writes its total, then the totals are scanned the same way and
+//added back on, so each level is 2 * L times shorter than the one below it; local_size must be a power of two
+void scanExclusive(cl::Context& context, cl::CommandQueue& queue, cl::Program& program, cl::Buffer& buffer, size_t n, size_t local_size, EventChain& chain, vector<cl::Event>& events) {
+	size_t groups = (n + 2 * local_size - 1) / (2 * local_size);
+	cl::Buffer buffer_sums(context, CL_MEM_READ_WRITE, groups * sizeof(cl_uint));
+
+	cl::Kernel kernel_scan = cl::Kernel(program, "scan_exclusive");
+	kernel_scan.setArg(0, buffer);
+	kernel_scan.setArg(1, (cl_int)n);
+	kernel_scan.setArg(2, buffer_sums);
+	kernel_scan.setArg(3, cl::Local(2 * local_size * sizeof(cl_uint)));//local memory size
+	events.push_back(cl::Event());
+	queue.enqueueNDRangeKernel(kernel_scan, cl::NullRange, cl::NDRange(groups * local_size), cl::NDRange(local_size), chain.deps(), &events.back());
+	chain.then(events.back());
+
+	if (groups > 1) {
+		scanExclusive(context, queue, program, buffer_sums, groups, local_size, chain, events);
+
+		cl::Kernel kernel_add = cl::Kernel(program, "scan_add");
+		kernel_add.setArg(0, buffer);
+		kernel_add.setArg(1, (cl_int)n);
+		kernel_add.setArg(2, buffer_sums);
+		events.push_back(cl::Event());
+		queue.enqueueNDRangeKernel(kernel_add, cl::NullRange, cl::NDRange(groups * local_size), cl::NDRange(local_size), chain.deps(), &events.back());
+		chain.then(events.back());
+	}
+}
 
-		//initialise some size variables for use later when creating buffers and kernels
-		size_t input_sizef = padded_temps.size() * sizeof(float);//size in bytes
-		size_t vector_elementsf = padded_temps.size();//number of elements
-		size_t output_size = output.size() * sizeof(int);//size in bytes
-		size_t output_sizef = output.size() * sizeof(float);
+//enqueues a sort of the temperatures with a least significant digit radix sort of the float bits, RADIX_BITS per pass,
+//starting once the after events complete
+//every pass builds a digit histogram per work group, scans it into output offsets and scatters the keys, so
+//any number of elements can be sorted without padding; the work group is capped at 256 to keep the local splits short
+//nothing blocks, the returned function prints the timings and hands over the sorted list once the queue has finished
+function<vector<float>()> radixSort(cl::Context& context, cl::CommandQueue& queue, cl::Program& program, DeviceTemps& temps, size_t local_size, const vector<cl::Event>& after) {
+	size_t n = temps.size;
+	size_t radix_local = 1;
+	while (radix_local * 2 <= local_size && radix_local * 2 <= 256)
+		radix_local *= 2;
+	size_t groups = (n + radix_local - 1) / radix_local;
+	size_t digits = (size_t)1 << RADIX_BITS;
+	size_t input_size = n * sizeof(float);
+	shared_ptr<vector<float>> sorted = make_shared<vector<float>>(n);
+
+	//the keys move between two buffers on every pass, with one histogram entry per digit per work group
+	cl::Buffer buffer_keys(context, CL_MEM_READ_WRITE, input_size);
+	cl::Buffer buffer_swap(context, CL_MEM_READ_WRITE, input_size);
+	cl::Buffer buffer_hist(context, CL_MEM_READ_WRITE, digits * groups * sizeof(cl_uint));
+
+	//profiling events for the buffers and kernels
+	cl::Event copy_event;
+	cl::Event sorted_download_event;
+	vector<cl::Event> key_events(2);
+	vector<cl::Event> histogram_events;
+	vector<cl::Event> scan_events;
+	vector<cl::Event> scatter_events;
+	EventChain chain(after);
+
+	//the first pass overwrites its keys so they start as a device to device copy of the temperatures
+	queue.enqueueCopyBuffer(temps.buffer, buffer_keys, 0, 0, input_size, chain.deps(), &copy_event);
+	chain.then(copy_event);
+
+	//create kernels
+	cl::Kernel kernel_to_key = cl::Kernel(program, "float_to_key");
+	cl::Kernel kernel_to_float = cl::Kernel(program, "key_to_float");
+	cl::Kernel kernel_histogram = cl::Kernel(program, "radix_histogram");
+	cl::Kernel kernel_scatter = cl::Kernel(program, "radix_scatter");
+	cl::NDRange global(groups * radix_local);
+	cl::NDRange local(radix_local);
+
+	//turn the floats into keys that sort as unsigned integers
+	kernel_to_key.setArg(0, buffer_keys);
+	kernel_to_key.setArg(1, (cl_int)n);
+	queue.enqueueNDRangeKernel(kernel_to_key, cl::NullRange, global, local, chain.deps(), &key_events[0]);
+	chain.then(key_events[0]);
+
+	for (cl_int shift = 0; shift < 32; shift += RADIX_BITS) {
+		kernel_histogram.setArg(0, buffer_keys);
+		kernel_histogram.setArg(1, (cl_int)n);
+		kernel_histogram.setArg(2, shift);
+		kernel_histogram.setArg(3, buffer_hist);
+		kernel_histogram.setArg(4, cl::Local(digits * sizeof(cl_uint)));//local memory size
+		histogram_events.push_back(cl::Event());
+		queue.enqueueNDRangeKernel(kernel_histogram, cl::NullRange, global, local, chain.deps(), &histogram_events.back());
+		chain.then(histogram_events.back());
+
+		scanExclusive(context, queue, program, buffer_hist, digits * groups, radix_local, chain, scan_events);
+
+		kernel_scatter.setArg(0, buffer_keys);
+		kernel_scatter.setArg(1, (cl_int)n);
+		kernel_scatter.setArg(2, buffer_swap);
+		kernel_scatter.setArg(3, shift);
+		kernel_scatter.setArg(4, buffer_hist);
+		kernel_scatter.setArg(5, cl::Local(radix_local * sizeof(cl_uint)));//sorted tile
+		kernel_scatter.setArg(6, cl::Local(radix_local * sizeof(cl_uint)));//split scan
+		kernel_scatter.setArg(7, cl::Local(digits * sizeof(cl_uint)));//digit starts
+		scatter_events.push_back(cl::Event());
+		queue.enqueueNDRangeKernel(kernel_scatter, cl::NullRange, global, local, chain.deps(), &scatter_events.back());
+		chain.then(scatter_events.back());
+
+		//the output of this pass is the input of the next
+		swap(buffer_keys, buffer_swap);
+	}
 
-		//device buffers
-		cl::Buffer buffer_output(context, CL_MEM_READ_WRITE, output_size);
-		cl::Buffer buffer_input(context, CL_MEM_READ_WRITE, input_sizef);
+	//turn the sorted keys back into floats and copy them to the host
+	kernel_to_float.setArg(0, buffer_keys);
+	kernel_to_float.setArg(1, (cl_int)n);
+	queue.enqueueNDRangeKernel(kernel_to_float, cl::NullRange, global, local, chain.deps(), &key_events[1]);
+	chain.then(key_events[1]);
+	queue.enqueueReadBuffer(buffer_keys, CL_FALSE, 0, input_size, &(*sorted)[0], chain.deps(), &sorted_download_event);
+
+	return [=]() {
+		cout << "\n\nRadix sort kernel timings:" << endl;
+		cout << "Device copy [ns]: " << copy_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - copy_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
+		cout << "\nKey conversion execution time [ns]: " << kernelTime(key_events) << endl;
+		cout << "Histogram launches: " << histogram_events.size() << ", execution time [ns]: " << kernelTime(histogram_events) << endl;
+		cout << "Scan launches: " << scan_events.size() << ", execution time [ns]: " << kernelTime(scan_events) << endl;
+		cout << "Scatter launches: " << scatter_events.size() << ", execution time [ns]: " << kernelTime(scatter_events) << endl;
+		cout << "\nSorted download [ns]: " << sorted_download_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - sorted_download_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
+		cout << "\nTotal radix sort time [ns]: " << sorted_download_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - copy_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
+
+		return move(*sorted);
+	};
+}
 
-		//profiling events for the buffers and kernel
-		cl::Event output_event;
-		cl::Event input_event;
-		cl::Event output_download_event;
-		cl::Event prof_event;
+//digit width of the radix select passes, matches SELECT_BITS in my_kernels.cl
+const int SELECT_BITS = 8;
 
-		//copy arrays input and output to device memory
-		queue.enqueueWriteBuffer(buffer_input, CL_TRUE, 0, input_sizef, &padded_temps[0], NULL, &input_event);
-		queue.enqueueFillBuffer(buffer_output, 0, 0, output_size, NULL, &output_event);//zero output buffer on device memory
+//inverse of float_key in my_kernels.cl
+float keyToFloat(cl_uint key) {
+	cl_uint bits = key ^ ((key >> 31) ? 0x80000000 : 0xFFFFFFFF);
+	float value;
+	memcpy(&value, &bits, sizeof(value));
+	return value;
+}
 
-		//create kernel and set arguments
-		cl::Kernel kernel_mean = cl::Kernel(program, "meanf");
-		kernel_mean.setArg(0, buffer_input);
-		kernel_mean.setArg(1, buffer_output);
-		kernel_mean.setArg(2, cl::Local(local_size * sizeof(float)));//local memory size
+//enqueues a search for the values at the given ranks of the sorted temperatures without sorting them, starting
+//once the after events complete
+//each pass histograms the next SELECT_BITS of the keys still matching every rank's prefix in one read of the data,
+//then radix_select_pick walks each histogram to the bucket holding the rank, fixing that digit of the prefix and
+//taking the keys in lower buckets off the rank; after 32 / SELECT_BITS passes every prefix is the exact key
+//nothing blocks, the returned function prints the timings and hands over the values once the queue has finished
+function<vector<float>()> radixSelect(cl::Context& context, cl::CommandQueue& queue, cl::Program& program, DeviceTemps& temps, size_t local_size, const vector<size_t>& ranks, const vector<cl::Event>& after) {
+	size_t n = temps.size;
+	size_t count = ranks.size();
+	size_t digits = (size_t)1 << SELECT_BITS;
+	size_t groups = (n + local_size - 1) / local_size;
+	size_t hist_size = count * digits * sizeof(cl_uint);
+	size_t ranks_size = count * sizeof(cl_uint);
+	//the upload source and download target have to outlive this function so they are shared with the returned function
+	shared_ptr<vector<cl_uint>> remaining = make_shared<vector<cl_uint>>(ranks.begin(), ranks.end());
+	shared_ptr<vector<cl_uint>> prefixes = make_shared<vector<cl_uint>>(count);
+
+	//device buffers
+	cl::Buffer buffer_prefixes(context, CL_MEM_READ_WRITE, ranks_size);
+	cl::Buffer buffer_remaining(context, CL_MEM_READ_WRITE, ranks_size);
+	cl::Buffer buffer_hist(context, CL_MEM_READ_WRITE, hist_size);
+
+	//profiling events for the buffers and kernels
+	cl::Event ranks_upload_event;
+	cl::Event prefixes_download_event;
+	vector<cl::Event> pass_events;
+	EventChain chain(after);
+
+	cl::Kernel kernel_select = cl::Kernel(program, "radix_select_histogram");
+	kernel_select.setArg(0, temps.buffer);
+	kernel_select.setArg(1, (cl_int)n);
+	kernel_select.setArg(3, buffer_prefixes);
+	kernel_select.setArg(4, (cl_int)count);
+	kernel_select.setArg(5, buffer_hist);
+	kernel_select.setArg(6, cl::Local(hist_size));//local memory size
+
+	cl::Kernel kernel_pick = cl::Kernel(program, "radix_select_pick");
+	kernel_pick.setArg(0, buffer_hist);
+	kernel_pick.setArg(2, buffer_prefixes);
+	kernel_pick.setArg(3, buffer_remaining);
+
+	//every prefix starts empty with the whole rank still to find
+	cl::Event prefixes_clear_event;
+	queue.enqueueWriteBuffer(buffer_remaining, CL_FALSE, 0, ranks_size, &(*remaining)[0], chain.deps(), &ranks_upload_event);
+	queue.enqueueFillBuffer(buffer_prefixes, (cl_uint)0, 0, ranks_size, chain.deps(), &prefixes_clear_event);
+	chain.wait.assign(1, ranks_upload_event);
+	chain.wait.push_back(prefixes_clear_event);
+
+	for (cl_int shift = 32 - SELECT_BITS; shift >= 0; shift -= SELECT_BITS) {
+		cl::Event clear_event;
+		cl::Event pick_event;
+		queue.enqueueFillBuffer(buffer_hist, (cl_uint)0, 0, hist_size, chain.deps(), &clear_event);
+		chain.then(clear_event);
+		kernel_select.setArg(2, shift);
+		pass_events.push_back(cl::Event());
+		queue.enqueueNDRangeKernel(kernel_select, cl::NullRange, cl::NDRange(groups * local_size), cl::NDRange(local_size), chain.deps(), &pass_events.back());
+		chain.then(pass_events.back());
+		kernel_pick.setArg(1, shift);
+		queue.enqueueNDRangeKernel(kernel_pick, cl::NullRange, cl::NDRange(count), cl::NullRange, chain.deps(), &pick_event);
+		chain.then(pick_event);
+	}
 
-		
+	queue.enqueueReadBuffer(buffer_prefixes, CL_FALSE, 0, ranks_size, &(*prefixes)[0], chain.deps(), &prefixes_download_event);
 
-		//start the kernel
-		queue.enqueueNDRangeKernel(kernel_mean, cl::NullRange, cl::NDRange(vector_elementsf), cl::NDRange(local_size), NULL, &prof_event);
+	//remaining is named in the captures although the function never reads it, so the upload source lives as long as it does
+	return [remaining, prefixes, count, pass_events, ranks_upload_event, prefixes_download_event]() {
+		cout << "\n\nRadix select kernel timings:" << endl;
+		cout << "Histogram passes: " << pass_events.size() << ", execution time [ns]: " << kernelTime(pass_events) << endl;
+		cout << "\nTotal time [ns]: " << prefixes_download_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - ranks_upload_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
 
-		//copy the result from device to host
-		queue.enqueueReadBuffer(buffer_output, CL_TRUE, 0, output_sizef, &output[0], NULL, &output_download_event);
+		vector<float> values(count);
+		for (size_t r = 0; r < count; r++)
+			values[r] = keyToFloat((*prefixes)[r]);
+		return values;
+	};
+}
 
-		cout << "Average kernel timings:" << endl;
-		cout << "Input upload [ns]: " << input_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - input_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
-		cout << "Output upload [ns]: " << output_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - output_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
-		cout << "\nKernel started" << endl;
-		cout << "Queued time [ns]: " << prof_event.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>() - prof_event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>() << endl;
-		cout << "Submitted time [ns]: " << prof_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() - prof_event.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>() << endl;
-		cout << "Kernal execution time [ns]:" << prof_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
-		cout << "Total kernel time [ns]: " << prof_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>() << endl;
-		cout << "\nOutput download [ns]: " << output_download_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - output_download_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
-		cout << "\nTotal time [ns]: " << output_download_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - input_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
+//largest power of two number of floats the device can sort in one go
+//every buffer of the sorts must fit in one allocation, and the radix sort of a run holds four of them at once: the run,
+//the two key buffers and the digit histograms, which are no larger than the run
+size_t deviceRunRecords(const cl::Device& device) {
+	cl_ulong max_alloc = device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+	cl_ulong global_mem = device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
+	cl_ulong limit = min(max_alloc, global_mem / 4) / sizeof(float);
+	size_t records = 1;
+	while (records * 2 <= limit)
+		records *= 2;
+	return records;
+}
 
-		//make sure previous kernel has finished before continuing
+//queues the statistics of the temperatures once the after events complete, see fusedStats and splitStats
+typedef function<function<StatsAccumulator()>(DeviceTemps&, const vector<cl::Event>&)> RunStats;
+
+//sorts n temperatures that do not fit on the device at once
+//each run of run_records values is uploaded, sorted on the device with the radix or bitonic sort and kept in host
+//memory, then the runs are merged on the CPU; run_records must be a power of two so the bitonic padding fits too
+//run_stats is queued on every run alongside its sort and the results merged into stats, so the data is uploaded only once
+vector<float> outOfCoreSort(cl::Context& context, cl::CommandQueue& queue, cl::Program& program, const float* temps, size_t n, size_t run_records, size_t local_size, bool radix_sort, const RunStats& run_stats, StatsAccumulator& stats) {
+	vector<vector<float>> runs;
+	for (size_t start = 0; start < n; start += run_records) {
+		DeviceTemps run;
+		run.size = min(run_records, n - start);
+		run.buffer = cl::Buffer(context, CL_MEM_READ_ONLY, run.size * sizeof(float));
+		vector<cl::Event> uploaded(1);
+		queue.enqueueWriteBuffer(run.buffer, CL_FALSE, 0, run.size * sizeof(float), temps + start, NULL, &uploaded[0]);
+		function<StatsAccumulator()> run_result = run_stats(run, uploaded);
+		function<vector<float>()> sorted;
+		if (radix_sort) {
+			sorted = radixSort(context, queue, program, run, local_size, uploaded);
+		}
+		else {
+			sorted = bitonicSort(context, queue, program, run, local_size, uploaded);
+		}
 		queue.finish();
+		cout << "\n\nRun " << runs.size() + 1 << " of " << (n + run_records - 1) / run_records << ", upload [ns]: " << uploaded[0].getProfilingInfo<CL_PROFILING_COMMAND_END>() - uploaded[0].getProfilingInfo<CL_PROFILING_COMMAND_START>();
+		stats.add(run_result(), start);
+		runs.push_back(sorted());
+	}
 
-		//initialise new kernel storage
-		output_sizef = (padded_temps.size() / local_size) * sizeof(float);
-		vector<float> maxs(output_sizef, 0.0f);
-		vector<float> mins(output_sizef, 0.0f);
+	auto merge_start = chrono::high_resolution_clock::now();
+	vector<float> merged = mergeRuns(runs, n);
+	auto merge_end = chrono::high_resolution_clock::now();
+	cout << "\n\nMerge of " << runs.size() << " runs [ms]: " << chrono::duration_cast<chrono::milliseconds>(merge_end - merge_start).count() << endl;
+	return merged;
+}
 
-		//create new kernel
-		cl::Kernel kernel_maxmin = cl::Kernel(program, "maxminf");
-		
-		//initialise new buffers
-		cl::Buffer buffer_maxs(context, CL_MEM_READ_WRITE, output_sizef);
-		cl::Buffer buffer_mins(context, CL_MEM_READ_WRITE, output_sizef);
+//first quartile, median and third quartile
+struct Quartiles {
+	float lower;
+	float median;
+	float upper;
+};
+
+//ranks of the sorted data that the quartiles are interpolated between
+//quartile q sits at position q * (n - 1), so the ranks are that position rounded down and up for q = 1/4, 1/2, 3/4
+vector<size_t> quartileRanks(size_t n) {
+	vector<size_t> ranks;
+	for (size_t q = 1; q <= 3; q++) {
+		size_t lo = q * (n - 1) / 4;
+		ranks.push_back(lo);
+		ranks.push_back(min(lo + 1, n - 1));
+	}
+	return ranks;
+}
 
-		//profiling events for the buffers and kernel
-		cl::Event max_output_upload_event;
-		cl::Event min_output_upload_event;
-		cl::Event max_output_download_event;
-		cl::Event min_output_download_event;
+//linear interpolation of the quartiles from the values found at quartileRanks(n)
+Quartiles quartilesFromRanks(size_t n, const vector<float>& values) {
+	float result[3];
+	for (size_t q = 1; q <= 3; q++) {
+		float fraction = (float)(q * (n - 1) % 4) / 4.0f;
+		float lo = values[2 * (q - 1)];
+		float hi = values[2 * (q - 1) + 1];
+		result[q - 1] = lo + (hi - lo) * fraction;
+	}
+	Quartiles quartiles;
+	quartiles.lower = result[0];
+	quartiles.median = result[1];
+	quartiles.upper = result[2];
+	return quartiles;
+}
 
-		//send buffers to device - both zeroed ready for output
-		queue.enqueueWriteBuffer(buffer_input, CL_TRUE, 0, input_sizef, &padded_temps[0], NULL, &input_event);
-		queue.enqueueFillBuffer(buffer_maxs, 0, 0, output_sizef, NULL, &max_output_upload_event);
-		queue.enqueueFillBuffer(buffer_mins, 0, 0, output_sizef, NULL, &min_output_upload_event);
+//main function
+//file in the working directory holding the tuned settings, one line per device and statistics path
+const string TUNING_FILE = "tuning.txt";
+//launches of each kernel per candidate, the fastest is kept so one slow launch does not decide the result
+const int TUNING_RUNS = 5;
+
+//settings found by the tuner, zero for anything that has not been tuned
+struct Tuning {
+	size_t local_size = 0;
+	size_t vector_width = 0;
+	size_t vector_items = 0;
+};
+
+//name of a statistics path in the tuning file
+string statsPathName(bool fused, bool sequential) {
+	return fused ? "fused" : (sequential ? "split-sequential" : "split-interleaved");
+}
 
-		//set kernel arguments
-		kernel_maxmin.setArg(0, buffer_input);
-		kernel_maxmin.setArg(1, buffer_maxs);
-		kernel_maxmin.setArg(2, buffer_mins);
-		kernel_maxmin.setArg(3, cl::Local(local_size * sizeof(float)));//local memory size
+//identifies the device in the tuning file, including the driver so an update is tuned again
+string tuningKey(const cl::Device& device) {
+	return device.getInfo<CL_DEVICE_NAME>() + " " + device.getInfo<CL_DRIVER_VERSION>();
+}
 
-		//start kernel
-		queue.enqueueNDRangeKernel(kernel_maxmin, cl::NullRange, cl::NDRange(vector_elementsf), cl::NDRange(local_size), NULL, &prof_event);
+//settings saved for a statistics path on the device
+//lines hold the device key, path name, work group size, vector width and vectors per work item separated by tabs
+//lines saved before the vectors per work item were tuned leave it at zero
+Tuning loadTuning(const string& key, const string& path) {
+	Tuning tuning;
+	ifstream in(TUNING_FILE);
+	string line;
+	while (getline(in, line)) {
+		size_t a = line.find('\t');
+		size_t b = line.find('\t', a + 1);
+		if (a == string::npos || b == string::npos)
+			continue;
+		if (line.compare(0, a, key) == 0 && line.compare(a + 1, b - a - 1, path) == 0) {
+			char* end;
+			tuning.local_size = (size_t)strtoul(line.c_str() + b + 1, &end, 10);
+			tuning.vector_width = (size_t)strtoul(end, &end, 10);
+			tuning.vector_items = (size_t)strtoul(end, NULL, 10);
+		}
+	}
+	return tuning;
+}
 
-		//retrieve outputs from device
-		queue.enqueueReadBuffer(buffer_maxs, CL_TRUE, 0, output_sizef, &maxs[0], NULL, &max_output_download_event);
-		queue.enqueueReadBuffer(buffer_mins, CL_TRUE, 0, output_sizef, &mins[0], NULL, &min_output_download_event);
+//saves the settings for a statistics path on the device, replacing any earlier result
+void saveTuning(const string& key, const string& path, const Tuning& tuning) {
+	vector<string> lines;
+	{
+		ifstream in(TUNING_FILE);
+		string line;
+		string prefix = key + "\t" + path + "\t";
+		while (getline(in, line))
+			if (line.compare(0, prefix.size(), prefix) != 0)
+				lines.push_back(line);
+		lines.push_back(prefix + to_string(tuning.local_size) + "\t" + to_string(tuning.vector_width) + "\t" + to_string(tuning.vector_items));
+	}
+	ofstream out(TUNING_FILE, ios::trunc);
+	for (const string& line : lines)
+		out << line << "\n";
+	if (!out)
+		cerr << "Warning: could not write " << TUNING_FILE << endl;
+}
 
+//times the kernels of a statistics path for every work group size the device allows, every vector width and, for the
+//vectorised kernels, every number of vectors per work item, and returns the fastest, with a zero work group size if
+//none of them ran; each candidate gets its own build and every kernel is timed with its profiling events, taking the
+//fastest of TUNING_RUNS launches
+//the interleaved path has no vectorised kernels so only its work group size is tuned
+Tuning tuneStats(cl::Context& context, cl::CommandQueue& queue, const cl::Device& device, DeviceTemps& temps, bool fused, bool sequential, bool fp64) {
+	//the largest size the device allows, then every power of two below it
+	vector<size_t> sizes(1, device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>());
+	size_t pow2 = 1;
+	while (pow2 * 2 < sizes[0])
+		pow2 *= 2;
+	for (; pow2 >= 16; pow2 /= 2)
+		sizes.push_back(pow2);
+	vector<size_t> widths(1, 1);
+	if (fused || sequential)
+		for (size_t w = 2; w <= 16; w *= 2)
+			widths.push_back(w);
+	vector<size_t> item_counts;
+	for (size_t items = 1; items <= 8; items *= 2)
+		item_counts.push_back(items);
+
+	//the variance kernels only need some mean to subtract
+	size_t sum_size = fp64 ? sizeof(cl_double) : sizeof(cl_float);
+	cl::Buffer buffer_mean(context, CL_MEM_READ_WRITE, sum_size);
+	queue.enqueueFillBuffer(buffer_mean, (cl_uchar)0, 0, sum_size);
+	queue.finish();
+
+	//candidates are built from source without the binary cache, only the winner is cached by the next normal run
+	cl::Program::Sources sources;
+	AddSources(sources, "kernels/my_kernels.cl");
+
+	cout << "Tuning " << statsPathName(fused, sequential) << " statistics kernels:" << endl;
+	Tuning best;
+	cl_ulong best_time = numeric_limits<cl_ulong>::max();
+	for (size_t width : widths) {
+		vector<string> kernels;
+		if (fused) {
+			kernels.push_back(vectorKernel("stats_fused", width));
+		}
+		else if (sequential) {
+			kernels.push_back(width > 1 ? "meanf_vec" : "meanf_seq");
+			kernels.push_back(vectorKernel("maxminf", width));
+			kernels.push_back(width > 1 ? "variance_vec" : "variance_seq");
+		}
+		else {
+			kernels.push_back("meanf");
+			kernels.push_back("maxminf");
+			kernels.push_back("variance");
+		}
 
-		cout << "\n\nMax and Min kernel timings:" << endl;
-		cout << "Input upload [ns]: " << input_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - input_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
-		cout << "Max upload [ns]: " << max_output_upload_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - max_output_upload_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
-		cout << "Min upload [ns]: " << min_output_upload_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - min_output_upload_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
-		cout << "\nKernel started" << endl;
-		cout << "Queued time [ns]: " << prof_event.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>() - prof_event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>() << endl;
-		cout << "Submitted time [ns]: " << prof_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() - prof_event.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>() << endl;
-		cout << "Kernal execution time [ns]:" << prof_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
-		cout << "Total kernel time [ns]: " << prof_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>() << endl;
-		cout << "\nMax download [ns]: " << max_output_download_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - max_output_download_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
-		cout << "Min download [ns]: " << min_output_download_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - min_output_download_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
-		cout << "\nTotal time [ns]: " << min_output_download_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - input_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
+		//the scalar kernels take one element per work item whatever the number, so only one is timed
+		for (size_t items : width > 1 ? item_counts : vector<size_t>(1, DEFAULT_VECTOR_ITEMS)) {
+			for (size_t L : sizes) {
+				try {
+					cl::Program program(context, sources);
+					program.build({ device }, buildOptions(device, L, width, items, fp64).c_str());
+					cl_ulong total = 0;
+					cout << "\nWork group size " << L << ", vector width " << width << ", vectors per work item " << items << endl;
+					for (const string& name : kernels) {
+						size_t item_size = name.compare(0, 11, "stats_fused") == 0 ? statsPartialSize(fp64) : (name.compare(0, 7, "maxminf") == 0 ? sizeof(MinMaxPartial) : sum_size);
+						size_t groups = statsGroups(name, temps.size, L, width, items);
+						cl::Buffer buffer_partials(context, CL_MEM_READ_WRITE, groups * item_size);
+
+						cl::Kernel kernel = cl::Kernel(program, name.c_str());
+						kernel.setArg(0, temps.buffer);
+						kernel.setArg(1, (cl_int)temps.size);
+						kernel.setArg(2, buffer_partials);
+						if (name.compare(0, 8, "variance") == 0) {
+							kernel.setArg(3, buffer_mean);
+							kernel.setArg(4, cl::Local(L * item_size));//local memory size
+						}
+						else {
+							kernel.setArg(3, cl::Local(L * item_size));//local memory size
+						}
+
+						cl_ulong fastest = numeric_limits<cl_ulong>::max();
+						for (int run = 0; run < TUNING_RUNS; run++) {
+							cl::Event prof_event;
+							queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(groups * L), cl::NDRange(L), NULL, &prof_event);
+							prof_event.wait();
+							fastest = min(fastest, prof_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event.getProfilingInfo<CL_PROFILING_COMMAND_START>());
+						}
+						cout << name << " [ns]: " << fastest << endl;
+						total += fastest;
+					}
+					cout << "Total [ns]: " << total << endl;
+					if (total < best_time) {
+						best_time = total;
+						best.local_size = L;
+						best.vector_width = width;
+						best.vector_items = items;
+					}
+				}
+				catch (const cl::Error& err) {
+					//too large for the kernels' registers or local memory
+					cout << "\nWork group size " << L << ", vector width " << width << ", vectors per work item " << items << " not supported: " << getErrorString(err.err()) << endl;
+				}
+			}
+		}
+	}
+	return best;
+}
 
-		//make sure previous kernel has finished before continuing
+//records of the probe slice timed on both sides to split a hybrid run, and the runs of each taking the fastest
+const size_t HYBRID_PROBE = 1 << 20;
+const int HYBRID_RUNS = 3;
+
+//share of the records the device should take when the statistics are split between it and the CPU
+//both sides summarise the same probe slice from the start of the data and the split is in proportion to their speed
+//the device is timed on the host clock from launch to the partials download, so launch overhead counts against it
+double hybridShare(cl::Context& context, cl::CommandQueue& queue, cl::Program& program, const DeviceTemps& temps, const float* host, size_t local_size, size_t vector_width, size_t vector_items, bool fused, bool sequential, bool fp64) {
+	DeviceTemps probe = temps;
+	probe.size = min(temps.size, HYBRID_PROBE);
+	double device_time = numeric_limits<double>::max();
+	double cpu_time = numeric_limits<double>::max();
+	for (int run = 0; run < HYBRID_RUNS; run++) {
+		auto device_start = chrono::high_resolution_clock::now();
+		//the returned function owns the download targets so it has to outlive the reads still queued
+		function<StatsAccumulator()> probe_result;
+		if (fused) {
+			probe_result = fusedStats(context, queue, program, probe, local_size, vector_width, vector_items, fp64, vector<cl::Event>());
+		}
+		else {
+			probe_result = splitStats(context, queue, program, probe, local_size, sequential, vector_width, vector_items, fp64, vector<cl::Event>());
+		}
 		queue.finish();
+		auto device_end = chrono::high_resolution_clock::now();
+		nativeStats(host, probe.size);
+		auto cpu_end = chrono::high_resolution_clock::now();
+		device_time = min(device_time, (double)chrono::duration_cast<chrono::nanoseconds>(device_end - device_start).count());
+		cpu_time = min(cpu_time, (double)chrono::duration_cast<chrono::nanoseconds>(cpu_end - device_end).count());
+	}
+	return cpu_time / (device_time + cpu_time);
+}
 
-		//calculate max and minimum value from partials
-		float max_val = maxs[0];
-		float min_val = mins[0];
-		for (int i = 1; i < maxs.size(); i++) {
-			if (maxs[i] > max_val) {
-				max_val = maxs[i];
+//merges the statistics of the first device_records records from the device with those of the rest from the CPU
+//the CPU indices start at device_records
+Stats mergeHybrid(const StatsAccumulator& device, size_t device_records, const StatsAccumulator& cpu) {
+	StatsAccumulator total = device;
+	total.add(cpu, device_records);
+	return total.result();
+}
+
+//prints the summary statistics with the station and time of the min and max
+void printStats(const Stats& stats, const string& min_record, const string& max_record) {
+	cout << "\n\nMean = " << stats.mean << endl;
+	cout << "Max = " << stats.max << " (" << max_record << ")" << endl;
+	cout << "Min = " << stats.min << " (" << min_record << ")" << endl;
+	cout << "Varience = " << stats.variance << endl;
+	cout << "Standard Deviation = " << stats.standard_deviation << endl;
+}
+
+//prints the quartiles after the summary statistics
+void printQuartiles(const Quartiles& quartiles) {
+	cout << "1st Quartile = " << quartiles.lower << endl;
+	cout <<"Meadian = " << quartiles.median << endl;
+	cout << "3rd Quatile = " << quartiles.upper << endl;
+}
+
+//loads the dataset at path into data, from the binary cache when it is up to date, and prints its size and load time
+//temp_storage optionally provides the temperature column, see loadDataCached
+//returns false once the error is printed if the file cannot be read or holds no records, as the quartiles and the
+//records of the min and max need at least one
+bool loadDataset(const string& path, TempDataset& data, const TempStorage& temp_storage = TempStorage()) {
+	bool from_cache = false;
+	cout << "Loading Data" << endl;
+	auto load_start = chrono::high_resolution_clock::now();
+	try {
+		data = loadDataCached(path, from_cache, temp_storage);
+	}
+	catch (const runtime_error& err) {
+		cerr << "ERROR: " << err.what() << endl;
+		return false;
+	}
+	auto load_end = chrono::high_resolution_clock::now();
+	cout << "Total size of dataset = " << data.size() << (from_cache ? " (cached)" : "") << endl;
+	cout << "Load time [ms]: " << chrono::duration_cast<chrono::milliseconds>(load_end - load_start).count() << endl;
+	if (data.size() == 0) {
+		cerr << "ERROR: " << path << " holds no records" << endl;
+		return false;
+	}
+	return true;
+}
+
+//one device of a multi device run with its own queue, build and shard of the records
+struct Shard {
+	cl::Context context;
+	cl::Device device;
+	cl::CommandQueue queue;
+	cl::Program program;
+	size_t local_size;
+	size_t vector_width;
+	size_t vector_items;
+	//records [first, first + temps.size) of the dataset
+	size_t first;
+	DeviceTemps temps;
+	vector<cl::Event> uploaded;
+	//place the shard's memory on the device's NUMA node, see uploadShard
+	bool first_touch = false;
+	//the sums of the mean and variance kernels are doubles
+	bool fp64 = false;
+};
+
+//relative speed of a device used to size its shard, compute units times clock
+//devices that report neither still count as one of each so the weights never all come out zero
+double deviceWeight(const cl::Device& device) {
+	return (double)max(device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>(), (cl_uint)1) * max(device.getInfo<CL_DEVICE_MAX_CLOCK_FREQUENCY>(), (cl_uint)1);
+}
+
+//uploads n values to a new buffer on the shard's device and returns the temperatures the kernels read
+//with first_touch the buffer is host memory filled by a copy the sub-device runs itself, so CPU runtimes that place
+//pages on the node first writing them keep each shard on the node whose cores read it
+DeviceTemps uploadShard(Shard& shard, const float* values, size_t n, vector<cl::Event>& uploaded) {
+	size_t bytes = max(n, (size_t)1) * sizeof(float);
+	DeviceTemps temps;
+	temps.size = n;
+	uploaded.assign(1, cl::Event());
+	if (shard.first_touch) {
+		temps.buffer = cl::Buffer(shard.context, CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR, bytes);
+		cl::Buffer source(shard.context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, bytes, (void*)values);
+		shard.queue.enqueueCopyBuffer(source, temps.buffer, 0, 0, n * sizeof(float), NULL, &uploaded[0]);
+	}
+	else {
+		temps.buffer = cl::Buffer(shard.context, CL_MEM_READ_ONLY, bytes);
+		shard.queue.enqueueWriteBuffer(temps.buffer, CL_FALSE, 0, n * sizeof(float), values, NULL, &uploaded[0]);
+	}
+	return temps;
+}
+
+//sorts the shards of every device with a sample sort by regular sampling
+//every device radix sorts its shard, then samples of the sorted shards give one splitter per device boundary, placed
+//so each device gets a share of the values matching its shard; the values of every shard between two splitters go to
+//that device, which sorts them again, and the devices' results in order are the sorted list
+vector<float> sampleSort(vector<Shard>& shards, size_t n) {
+	vector<function<vector<float>()>> results(shards.size());
+	for (size_t d = 0; d < shards.size(); d++)
+		if (shards[d].temps.size > 0)
+			results[d] = radixSort(shards[d].context, shards[d].queue, shards[d].program, shards[d].temps, shards[d].local_size, shards[d].uploaded);
+	vector<vector<float>> runs(shards.size());
+	for (size_t d = 0; d < shards.size(); d++) {
+		shards[d].queue.finish();
+		if (results[d]) {
+			cout << "\n\nDevice " << d << " shard sort" << endl;
+			runs[d] = results[d]();
+		}
+	}
+
+	//regular samples of every sorted shard, then a splitter wherever the shards before it end in the samples
+	vector<float> samples;
+	for (const vector<float>& run : runs)
+		for (size_t s = 0; s < shards.size() && !run.empty(); s++)
+			samples.push_back(run[run.size() * s / shards.size()]);
+	sort(samples.begin(), samples.end());
+	vector<float> splitters;
+	for (size_t d = 1; d < shards.size(); d++)
+		splitters.push_back(samples[min(samples.size() * shards[d].first / n, samples.size() - 1)]);
+
+	//gather the partition of every device from the shards and sort it there
+	vector<vector<float>> partitions(shards.size());
+	for (const vector<float>& run : runs) {
+		size_t start = 0;
+		for (size_t d = 0; d < shards.size(); d++) {
+			size_t end = d + 1 < shards.size() ? lower_bound(run.begin() + start, run.end(), splitters[d]) - run.begin() : run.size();
+			partitions[d].insert(partitions[d].end(), run.begin() + start, run.begin() + end);
+			start = end;
+		}
+	}
+	for (size_t d = 0; d < shards.size(); d++) {
+		if (partitions[d].empty())
+			continue;
+		vector<cl::Event> uploaded;
+		DeviceTemps partition = uploadShard(shards[d], partitions[d].data(), partitions[d].size(), uploaded);
+		results[d] = radixSort(shards[d].context, shards[d].queue, shards[d].program, partition, shards[d].local_size, uploaded);
+		shards[d].queue.flush();
+	}
+	vector<float> sorted;
+	sorted.reserve(n);
+	for (size_t d = 0; d < shards.size(); d++) {
+		shards[d].queue.finish();
+		if (partitions[d].empty())
+			continue;
+		cout << "\n\nDevice " << d << " partition sort, " << partitions[d].size() << " values" << endl;
+		vector<float> part = results[d]();
+		sorted.insert(sorted.end(), part.begin(), part.end());
+	}
+	return sorted;
+}
+
+//finds the values at the given ranks of the records of every shard without sorting them
+//the same passes as radixSelect, except that every device histograms the keys of its own shard and the host adds the
+//histograms up and picks the buckets, writing the prefixes back to every device before the next pass
+vector<float> shardSelect(vector<Shard>& shards, const vector<size_t>& ranks) {
+	size_t count = ranks.size();
+	size_t digits = (size_t)1 << SELECT_BITS;
+	size_t hist_size = count * digits * sizeof(cl_uint);
+	size_t ranks_size = count * sizeof(cl_uint);
+	vector<cl_uint> remaining(ranks.begin(), ranks.end());
+	vector<cl_uint> prefixes(count, 0);
+	vector<vector<cl_uint>> hists(shards.size(), vector<cl_uint>(count * digits));
+
+	//device buffers and kernels of every shard holding records
+	vector<cl::Buffer> buffer_prefixes(shards.size());
+	vector<cl::Buffer> buffer_hist(shards.size());
+	vector<cl::Kernel> kernels(shards.size());
+	vector<vector<cl::Event>> pass_events(shards.size());
+	for (size_t d = 0; d < shards.size(); d++) {
+		Shard& shard = shards[d];
+		if (shard.temps.size == 0)
+			continue;
+		buffer_prefixes[d] = cl::Buffer(shard.context, CL_MEM_READ_ONLY, ranks_size);
+		buffer_hist[d] = cl::Buffer(shard.context, CL_MEM_READ_WRITE, hist_size);
+		kernels[d] = cl::Kernel(shard.program, "radix_select_histogram");
+		kernels[d].setArg(0, shard.temps.buffer);
+		kernels[d].setArg(1, (cl_int)shard.temps.size);
+		kernels[d].setArg(3, buffer_prefixes[d]);
+		kernels[d].setArg(4, (cl_int)count);
+		kernels[d].setArg(5, buffer_hist[d]);
+		kernels[d].setArg(6, cl::Local(hist_size));//local memory size
+	}
+
+	for (cl_int shift = 32 - SELECT_BITS; shift >= 0; shift -= SELECT_BITS) {
+		for (size_t d = 0; d < shards.size(); d++) {
+			Shard& shard = shards[d];
+			if (shard.temps.size == 0)
+				continue;
+			size_t groups = (shard.temps.size + shard.local_size - 1) / shard.local_size;
+			EventChain chain(shard.uploaded);
+			cl::Event prefixes_upload_event;
+			cl::Event clear_event;
+			shard.queue.enqueueWriteBuffer(buffer_prefixes[d], CL_FALSE, 0, ranks_size, &prefixes[0], chain.deps(), &prefixes_upload_event);
+			shard.queue.enqueueFillBuffer(buffer_hist[d], (cl_uint)0, 0, hist_size, chain.deps(), &clear_event);
+			chain.wait.assign(1, prefixes_upload_event);
+			chain.wait.push_back(clear_event);
+			kernels[d].setArg(2, shift);
+			pass_events[d].push_back(cl::Event());
+			shard.queue.enqueueNDRangeKernel(kernels[d], cl::NullRange, cl::NDRange(groups * shard.local_size), cl::NDRange(shard.local_size), chain.deps(), &pass_events[d].back());
+			chain.then(pass_events[d].back());
+			shard.queue.enqueueReadBuffer(buffer_hist[d], CL_FALSE, 0, hist_size, &hists[d][0], chain.deps());
+			shard.queue.flush();
+		}
+		for (Shard& shard : shards)
+			shard.queue.finish();
+
+		//walk the histograms of all the shards added up to the bucket holding each rank, as radix_select_pick does
+		for (size_t r = 0; r < count; r++) {
+			cl_uint digit = 0;
+			for (; digit + 1 < digits; digit++) {
+				cl_uint bucket = 0;
+				for (size_t d = 0; d < shards.size(); d++)
+					bucket += hists[d][r * digits + digit];
+				if (remaining[r] < bucket)
+					break;
+				remaining[r] -= bucket;
+			}
+			prefixes[r] |= digit << shift;
+		}
+	}
+
+	for (size_t d = 0; d < shards.size(); d++)
+		if (!pass_events[d].empty())
+			cout << "\n\nDevice " << d << " radix select histogram passes: " << pass_events[d].size() << ", execution time [ns]: " << kernelTime(pass_events[d]) << endl;
+
+	vector<float> values(count);
+	for (size_t r = 0; r < count; r++)
+		values[r] = keyToFloat(prefixes[r]);
+	return values;
+}
+
+//loads the dataset and calculates everything on every device of the contexts, each reducing a shard sized by
+//deviceWeight, with the quartiles from the sample sort with show_sorted and shardSelect otherwise; first_touch places
+//every shard in its device's memory node and fp64 sums in double on the devices supporting it
+int runMultiDevice(const vector<cl::Context>& contexts, const string& data_path, bool show_sorted, int work_groups, int vector_option, bool fused_stats, bool sequential_sums, bool first_touch, bool fp64) {
+	vector<Shard> shards;
+	for (const cl::Context& context : contexts) {
+		for (const cl::Device& device : context.getInfo<CL_CONTEXT_DEVICES>()) {
+			Shard shard;
+			shard.context = context;
+			shard.device = device;
+			shard.first_touch = first_touch;
+			shard.fp64 = fp64 && supportsFp64(device);
+			Tuning tuned = loadTuning(tuningKey(device), statsPathName(fused_stats, sequential_sums));
+			shard.local_size = work_groups > 0 ? work_groups : (tuned.local_size > 0 ? tuned.local_size : device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>());
+			shard.vector_width = vector_option > 0 ? vector_option : (tuned.vector_width > 0 ? tuned.vector_width : preferredVectorWidth(device));
+			shard.vector_items = tuned.vector_items > 0 ? tuned.vector_items : DEFAULT_VECTOR_ITEMS;
+			if (shard.vector_width != 1 && shard.vector_width != 2 && shard.vector_width != 4 && shard.vector_width != 8 && shard.vector_width != 16) {
+				cerr << "ERROR: vector width must be 1, 2, 4, 8 or 16" << endl;
+				return 1;
 			}
-			if (mins[i] < min_val) {
-				min_val = mins[i];
+			cl_command_queue_properties queue_properties = CL_QUEUE_PROFILING_ENABLE | (device.getInfo<CL_DEVICE_QUEUE_PROPERTIES>() & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE);
+			shard.queue = cl::CommandQueue(context, device, queue_properties);
+			try {
+				BuildProgramCached(context, device, "kernels/my_kernels.cl", buildOptions(device, shard.local_size, shard.vector_width, shard.vector_items, shard.fp64), shard.program);
 			}
+			catch (const cl::Error&) {
+				cout << "Build Log:\t " << shard.program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device) << endl;
+				throw;
+			}
+			cout << "Device " << shards.size() << ": " << device.getInfo<CL_DEVICE_NAME>() << ", work group size " << shard.local_size << ", vector width " << shard.vector_width << endl;
+			shards.push_back(shard);
 		}
+	}
+	if (shards.empty()) {
+		cerr << "ERROR: no OpenCL devices found" << endl;
+		return 1;
+	}
 
-		// calculate average
-		float x = output[0] / 10.0f;
-		float mean_val = x / temps.size();
+	TempDataset data;
+	if (!loadDataset(data_path, data))
+		return 1;
+
+	//set precision so decimals are shown on large numbers
+	cout.precision(10);
+
+	//shard the records in proportion to the weight of each device and queue every shard's reduction
+	double total_weight = 0.0;
+	for (const Shard& shard : shards)
+		total_weight += deviceWeight(shard.device);
+	double weight = 0.0;
+	vector<function<StatsAccumulator()>> stats_results(shards.size());
+	for (size_t d = 0; d < shards.size(); d++) {
+		Shard& shard = shards[d];
+		shard.first = (size_t)(data.size() * weight / total_weight);
+		weight += deviceWeight(shard.device);
+		size_t last = d + 1 < shards.size() ? (size_t)(data.size() * weight / total_weight) : data.size();
+		//small inputs can leave a device without records, and a zero byte upload is an error
+		if (last == shard.first)
+			continue;
+		shard.temps = uploadShard(shard, data.temp + shard.first, last - shard.first, shard.uploaded);
+		if (fused_stats) {
+			stats_results[d] = fusedStats(shard.context, shard.queue, shard.program, shard.temps, shard.local_size, shard.vector_width, shard.vector_items, shard.fp64, shard.uploaded);
+		}
+		else {
+			stats_results[d] = splitStats(shard.context, shard.queue, shard.program, shard.temps, shard.local_size, sequential_sums, shard.vector_width, shard.vector_items, shard.fp64, shard.uploaded);
+		}
+		shard.queue.flush();
+	}
 
-		//set precision so decimals are shown on large numbers
-		cout.precision(10);
+	//merge the shards' statistics, the sort or select queues up behind them on every device
+	vector<size_t> ranks = quartileRanks(data.size());
+	vector<float> sorted;
+	vector<float> rank_values;
+	if (show_sorted) {
+		sorted = sampleSort(shards, data.size());
+		for (size_t rank : ranks)
+			rank_values.push_back(sorted[rank]);
+	}
+	else {
+		rank_values = shardSelect(shards, ranks);
+	}
+	StatsAccumulator total;
+	for (size_t d = 0; d < shards.size(); d++) {
+		if (!stats_results[d])
+			continue;
+		cout << "\n\nDevice " << d << " records " << shards[d].first << " to " << shards[d].first + shards[d].temps.size << ", upload [ns]: " << shards[d].uploaded[0].getProfilingInfo<CL_PROFILING_COMMAND_END>() - shards[d].uploaded[0].getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
+		total.add(stats_results[d](), shards[d].first);
+	}
+	Stats stats = total.result();
 
-		//pad variance vector
-		vector<float> padded_temps_variance(temps.begin(), temps.end());
-		padding_size = local_size - (padded_temps_variance.size() % local_size);
-		//if the input vector is not a multiple of the local_size
-		//insert additional neutral elements (0 for addition) so that the total will not be affected
-		if (padding_size) {
-			//create an extra vector with neutral values
-			vector<float> var_ext(padding_size, mean_val);
-			//append that extra vector to our input
-			padded_temps_variance.insert(padded_temps_variance.end(), var_ext.begin(), var_ext.end());
-		}
-		
-		//set kernel input, output and size variables
-		vector<float> mean(1);
-		vector<int64_t> varsum(1);
-		input_sizef = padded_temps_variance.size() * sizeof(float);
-		output_size = varsum.size() * sizeof(int64_t);
-		output_sizef = 1 * sizeof(float);
-		
-		varsum[0] = (int64_t)0;
-		mean[0] = mean_val;
-
-		//initialise new buffers
-		cl::Buffer buffer_mean(context, CL_MEM_READ_ONLY, mean.size() * sizeof(float));
-		cl::Buffer buffer_varsum(context, CL_MEM_READ_WRITE, output_size);
-		cl::Buffer buffer_padded_variance(context, CL_MEM_READ_ONLY, input_sizef);
-		
-		cl::Event mean_value_upload_event;
-		cl::Event varsum_output_upload_event;
-		cl::Event mean_value_download_event;
-		cl::Event varsum_output_download_event;
-
-		//send buffers to device
-		queue.enqueueWriteBuffer(buffer_padded_variance, CL_TRUE, 0, input_sizef, &padded_temps_variance[0], NULL, &input_event);
-		queue.enqueueWriteBuffer(buffer_mean, CL_TRUE, 0, mean.size() * sizeof(float), &mean[0], NULL, &mean_value_upload_event);
-		queue.enqueueWriteBuffer(buffer_varsum, CL_TRUE, 0, output_size, &varsum[0], NULL, &varsum_output_upload_event);
-		
-
-		//create kernel
-		cl::Kernel kernel_var = cl::Kernel(program, "variance");
-
-		//set kernel arguments
-		kernel_var.setArg(0, buffer_padded_variance);
-		kernel_var.setArg(1, buffer_varsum);
-		kernel_var.setArg(2, buffer_mean);
-		kernel_var.setArg(3, cl::Local(local_size * sizeof(float)));//local memory size
-
-		//start kernel
-		queue.enqueueNDRangeKernel(kernel_var, cl::NullRange, cl::NDRange(padded_temps_variance.size()), cl::NDRange(local_size), NULL, &prof_event);
-
-		//retrieve output from device
-		queue.enqueueReadBuffer(buffer_varsum, CL_TRUE, 0, output_size, &varsum[0], NULL, &varsum_output_download_event);
+	if (show_sorted)
+		cout << "Sorted List" << sorted << endl;
+	Quartiles quartiles = quartilesFromRanks(data.size(), rank_values);
 
-		cout << "\n\nVariance squared difference kernel timings:" << endl;
-		cout << "Input upload [ns]: " << input_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - input_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
-		cout << "Mean value upload [ns]: " << mean_value_upload_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - mean_value_upload_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
-		cout << "Intermidiate squared difference sum upload [ns]: " << varsum_output_upload_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - varsum_output_upload_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
-		cout << "\nKernel started" << endl;
-		cout << "Queued time [ns]: " << prof_event.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>() - prof_event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>() << endl;
-		cout << "Submitted time [ns]: " << prof_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() - prof_event.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>() << endl;
-		cout << "Kernal execution time [ns]:" << prof_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
-		cout << "Total kernel time [ns]: " << prof_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>() << endl;
-		cout << "Intermidiate squared difference sum download [ns]: " << varsum_output_download_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - varsum_output_download_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
-		cout << "\nTotal time [ns]: " << varsum_output_download_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - input_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
+	printStats(stats, describeRecord(data, stats.min_index), describeRecord(data, stats.max_index));
+	printQuartiles(quartiles);
+	return 0;
+}
 
-		//calculate variance and standard deviation
-		float variance_value = (float)varsum[0] / (100.0f * temps.size());
-		float standard_deviation_val = sqrt(varsum[0] / (100.0f * temps.size()));
-		
-		//pad temperature array for sorting - must be power of 2 to work with bitonic sort
-		vector<float> padded_sort_temps(temps.begin(), temps.end());
-		float pos = ceil(log2(padded_sort_temps.size()));
-		int power = pow(2, pos);
-		padding_size = power - padded_sort_temps.size();
-		//if the input vector is not a multiple of the local_size
-		//insert additional neutral elements (0 for addition) so that the total will not be affected
-		if (padding_size) {
-			//create an extra vector with neutral values - 999.9 is greater than any temperature in dataset
-			vector<float> A_ext(padding_size, 999.9f);
-			//append that extra vector to our input
-			padded_sort_temps.insert(padded_sort_temps.end(), A_ext.begin(), A_ext.end());
-		}
+//loads the dataset and calculates everything on the CPU with the native backend in NativeStats.h, printing the
+//same results as the OpenCL path with the time each step took
+int runNative(const string& data_path, bool show_sorted) {
+	cout << "Running natively on the CPU, " << hardwareThreads() << " threads, " << nativeSimdName() << endl;
+
+	TempDataset data;
+	if (!loadDataset(data_path, data))
+		return 1;
+
+	//set precision so decimals are shown on large numbers
+	cout.precision(10);
+
+	auto stats_start = chrono::high_resolution_clock::now();
+	Stats stats = nativeStats(data.temp, data.size()).result();
+	auto stats_end = chrono::high_resolution_clock::now();
+	cout << "Native statistics [ns]: " << chrono::duration_cast<chrono::nanoseconds>(stats_end - stats_start).count() << endl;
+
+	vector<size_t> ranks = quartileRanks(data.size());
+	vector<float> rank_values(ranks.size());
+	if (show_sorted) {
+		auto sort_start = chrono::high_resolution_clock::now();
+		vector<float> sorted = nativeSort(data.temp, data.size());
+		auto sort_end = chrono::high_resolution_clock::now();
+		cout << "Native sort [ns]: " << chrono::duration_cast<chrono::nanoseconds>(sort_end - sort_start).count() << endl;
+		cout << "Sorted List" << sorted << endl;
+		for (size_t i = 0; i < ranks.size(); i++)
+			rank_values[i] = sorted[ranks[i]];
+	}
+	else {
+		auto select_start = chrono::high_resolution_clock::now();
+		rank_values = nativeSelect(data.temp, data.size(), ranks);
+		auto select_end = chrono::high_resolution_clock::now();
+		cout << "Native select [ns]: " << chrono::duration_cast<chrono::nanoseconds>(select_end - select_start).count() << endl;
+	}
+	Quartiles quartiles = quartilesFromRanks(data.size(), rank_values);
+
+	printStats(stats, describeRecord(data, stats.min_index), describeRecord(data, stats.max_index));
+	printQuartiles(quartiles);
+	return 0;
+}
 
-		//Bitonic sort - start with initial stage to set up stage 0
+int main(int argc, char** argv)
+{
+	//initialise option variables
+	int platformID = 0;
+	int deviceID = 0;
+	int work_groups = 0;
+	bool show_sorted = false;
+	bool fused_stats = true;
+	bool sequential_sums = true;
+	bool radix_sort = true;
+	size_t stream_mb = 0;
+	size_t run_mb = 0;
+	bool tune = false;
+	int vector_option = 0;
+	bool native = false;
+	bool hybrid = false;
+	bool multi_device = false;
+	bool all_platforms = false;
+	bool numa = false;
+	bool fp64_option = false;
 
-		//initialise vector to be sorted
-		vector<float> sortVec(padded_sort_temps.size());
+	//check command line arguments and set options
+	for (int i = 1; i < argc; i++) {
+		if ((strcmp(argv[i], "-p") == 0) && (i < (argc - 1))) { platformID = atoi(argv[++i]); }
+		else if ((strcmp(argv[i], "-d") == 0) && (i < (argc - 1))) { deviceID = atoi(argv[++i]); }
+		else if (strcmp(argv[i], "-l") == 0) { cout << ListPlatformsDevices() << endl; }
+		else if (strcmp(argv[i], "-h") == 0) { print_help(); return 0; }
+		else if (strcmp(argv[i], "-s") == 0) { show_sorted = true; }
+		else if ((strcmp(argv[i], "-g") == 0) && (i < (argc - 1))) { work_groups = atoi(argv[++i]); }
+		else if ((strcmp(argv[i], "-k") == 0) && (i < (argc - 1))) { fused_stats = (strcmp(argv[++i], "split") != 0); }
+		else if ((strcmp(argv[i], "-r") == 0) && (i < (argc - 1))) { sequential_sums = (strcmp(argv[++i], "interleaved") != 0); }
+		else if ((strcmp(argv[i], "-a") == 0) && (i < (argc - 1))) { radix_sort = (strcmp(argv[++i], "bitonic") != 0); }
+		else if (strcmp(argv[i], "-t") == 0) { tune = true; }
+		else if ((strcmp(argv[i], "-v") == 0) && (i < (argc - 1))) { vector_option = atoi(argv[++i]); }
+		else if ((strcmp(argv[i], "-o") == 0) && (i < (argc - 1))) { run_mb = (size_t)max(atoi(argv[++i]), 0); }
+		else if ((strcmp(argv[i], "-c") == 0) && (i < (argc - 1))) { stream_mb = (size_t)max(atoi(argv[++i]), 0); }
+		else if (strcmp(argv[i], "-n") == 0) { native = true; }
+		else if (strcmp(argv[i], "-b") == 0) { hybrid = true; }
+		else if ((strcmp(argv[i], "-m") == 0) && (i < (argc - 1))) { multi_device = true; all_platforms = (strcmp(argv[++i], "all") == 0); }
+		else if (strcmp(argv[i], "-u") == 0) { numa = true; }
+		else if (strcmp(argv[i], "-f") == 0) { fp64_option = true; }
+	}
 
-		//initialise buffer for kernel
-		cl::Buffer buffer_sort_temps(context, CL_MEM_READ_WRITE, sortVec.size() * sizeof(float));
+	//streaming summarises each chunk with the fused kernel on one device as it is parsed and never holds the whole
+	//dataset, so nothing that sorts, tunes, splits the kernels or runs anywhere else can go with it
+	if (stream_mb > 0 && (show_sorted || hybrid || tune || !fused_stats || native || multi_device || numa)) {
+		cerr << "ERROR: -c cannot be combined with -s, -b, -t, -k split, -n, -m or -u" << endl;
+		return 1;
+	}
 
-		//profiling events
-		cl::Event sort_temps_upload_event;
-		cl::Event sort_temps_download_event;
+	const string data_path = "temp_lincolnshire_datasets/temp_lincolnshire.txt";
+	//the native backend needs no OpenCL platform at all
+	if (native)
+		return runNative(data_path, show_sorted);
 
-		//write buffer to device
-		queue.enqueueWriteBuffer(buffer_sort_temps, CL_TRUE, 0, sortVec.size() * sizeof(float), &padded_sort_temps[0], NULL, &sort_temps_upload_event);
+	try {
+		if (multi_device)
+			return runMultiDevice(GetPlatformContexts(all_platforms ? -1 : platformID), data_path, show_sorted, work_groups, vector_option, fused_stats, sequential_sums, false, fp64_option);
+		if (numa) {
+			//first touch placement only means something when every shard has a memory node of its own
+			bool partitioned = false;
+			cl::Context numa_context = GetNumaContext(platformID, deviceID, partitioned);
+			return runMultiDevice(vector<cl::Context>(1, numa_context), data_path, show_sorted, work_groups, vector_option, fused_stats, sequential_sums, partitioned, fp64_option);
+		}
 
-		//create kernel
-		cl::Kernel kernel_initial = cl::Kernel(program, "bitonic_initial");
+		//host operations
+		//select computing devices
+		cl::Context context = GetContext(platformID, deviceID);
 
-		//set kernel arguments
-		kernel_initial.setArg(0, buffer_sort_temps);
+		// get device
+		cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0]; 
 
-		//start kernel
-		queue.enqueueNDRangeKernel(kernel_initial, cl::NullRange, cl::NDRange(sortVec.size()), cl::NullRange, NULL, &prof_event);
+		//set work group size
+		Tuning tuned = loadTuning(tuningKey(device), statsPathName(fused_stats, sequential_sums));
+		size_t local_size;
+		if (work_groups > 0) {
+			local_size = work_groups;
+		}
+		else if (tuned.local_size > 0) {
+			//use the size tuned for this device with -t
+			local_size = tuned.local_size;
+			cout << "Tuned work group size: " << local_size << endl;
+		}
+		else {
+			//set workgroup size to max value available for the device - datasets are large so a large value is useful
+			local_size = device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+		}
 
-		//retrieve sorted vector stage 0 from device
-		queue.enqueueReadBuffer(buffer_sort_temps, CL_TRUE, 0, sortVec.size() * sizeof(float), &sortVec[0], NULL, &sort_temps_download_event);
+		//vector width of the statistics kernels, from -v, the tuner or the device
+		size_t vector_width = preferredVectorWidth(device);
+		if (vector_option > 0)
+			vector_width = (size_t)vector_option;
+		else if (tuned.vector_width > 0)
+			vector_width = tuned.vector_width;
+		if (vector_width != 1 && vector_width != 2 && vector_width != 4 && vector_width != 8 && vector_width != 16) {
+			cerr << "ERROR: vector width must be 1, 2, 4, 8 or 16" << endl;
+			return 1;
+		}
+		cout << "Vector width: " << vector_width << endl;
+		//vectors each work item loads per grid stride, from the tuner or the default
+		size_t vector_items = tuned.vector_items > 0 ? tuned.vector_items : DEFAULT_VECTOR_ITEMS;
+
+		//double precision sums for the mean and variance kernels, fused or split, when asked for and available
+		bool fp64 = fp64_option && supportsFp64(device);
+		if (fp64_option && !fp64)
+			cerr << "Warning: the device does not support cl_khr_fp64, summing in compensated single precision" << endl;
+		//display the selected device
+		cout << "Runinng on " << GetPlatformName(platformID) << ", " << GetDeviceName(platformID, deviceID) << endl;
 
-		cout << "\n\nBitonic stage 0 kernel timings:" << endl;
-		cout << "Input upload [ns]: " << sort_temps_upload_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - sort_temps_upload_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
-		cout << "\nKernel started" << endl;
-		cout << "Queued time [ns]: " << prof_event.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>() - prof_event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>() << endl;
-		cout << "Submitted time [ns]: " << prof_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() - prof_event.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>() << endl;
-		cout << "Kernal execution time [ns]:" << prof_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
-		cout << "Total kernel time [ns]: " << prof_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>() << endl;
-		cout << "\nStage 0 download [ns]: " << sort_temps_download_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - sort_temps_download_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
-		cout << "\nTotal time [ns]: " << sort_temps_download_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - sort_temps_upload_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
-
-		//Bitonic sort stage N - loop until final stage is reached, sorting larger sizes of bitonic groups
-
-		//initialise buffer for kernel
-		cl::Buffer buffer_stage(context, CL_MEM_READ_ONLY, 1 * sizeof(int));
-
-		//profiling events
-		cl::Event stage_upload_event;
-		cl::Event stage_download_event;
-
-		//create kernel
-		cl::Kernel kernel_bitonic_sortn = cl::Kernel(program, "bitonic_nmerge");
-
-		//set kernel arguments
-		kernel_bitonic_sortn.setArg(0, buffer_sort_temps);
-
-		
-		//loop calling kernel with different stage
-		for (int stages = 0; stages < log2(sortVec.size()); stages++)
-		{
-			//write buffer to device
-			queue.enqueueFillBuffer(buffer_stage, stages, 0, 1 * sizeof(int));
-			//set kernel argument
-			kernel_bitonic_sortn.setArg(1, buffer_stage);
-			//start kernel
-			queue.enqueueNDRangeKernel(kernel_bitonic_sortn, cl::NullRange, cl::NDRange(sortVec.size()), cl::NullRange, NULL, &prof_event);
-			//wait for queue to finish before moving to next stage
-			queue.finish();
-			cout << "\n\nBitonic stage " << stages+1 <<  " kernel timings:" << endl;
-			cout << "\nKernel started" << endl;
-			cout << "Queued time [ns]: " << prof_event.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>() - prof_event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>() << endl;
-			cout << "Submitted time [ns]: " << prof_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() - prof_event.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>() << endl;
-			cout << "Kernal execution time [ns]:" << prof_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
-			cout << "Total kernel time [ns]: " << prof_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>() << endl;
-			cout << "\nTotal time [ns]: " << prof_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
-			
-		}
-
-		//event for profiling
-		cl::Event sorted_download_event;
-
-		//create final stage kernel to sort final bitonic sequence
-		cl::Kernel kernel_bitonic_finish = cl::Kernel(program, "bitonic_merge_final");
-
-		//set kernel argument
-		kernel_bitonic_finish.setArg(0, buffer_sort_temps);
-
-		//start kernel
-		queue.enqueueNDRangeKernel(kernel_bitonic_finish, cl::NullRange, cl::NDRange(padded_sort_temps.size()), cl::NullRange, NULL, &prof_event);
-
-		//retrieve sorted vector from device
-		queue.enqueueReadBuffer(buffer_sort_temps, CL_TRUE, 0, sortVec.size() * sizeof(float), &sortVec[0], NULL, &sorted_download_event);
-
-		cout << "\n\nFinal bitonic stage kernel timings:" << endl;
-		cout << "\nKernel started" << endl;
-		cout << "Queued time [ns]: " << prof_event.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>() - prof_event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>() << endl;
-		cout << "Submitted time [ns]: " << prof_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() - prof_event.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>() << endl;
-		cout << "Kernal execution time [ns]:" << prof_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
-		cout << "Total kernel time [ns]: " << prof_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>() << endl;
-		cout << "\nFinal stage download [ns]: " << sorted_download_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - sorted_download_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
-		cout << "\nTotal time [ns]: " << prof_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
-
-		cout << "\n\nTotal bitonic sort time [ns]: " << prof_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - sort_temps_upload_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl;
-
-		//remove extra padding from sorted array
-		vector<float> final(temps.size());
-		for (int i = 0; i < temps.size(); i++) {
-			final[i] = sortVec[i];
-		}
-
-		//show sorted list if argument is set
-		if (show_sorted)
-		{
-			cout << "Sorted List" << final << endl;
-		}
-
-		//calculate median, 1st and 3rd quartiles from sorted list
-		float median;
-		float upperQ;
-		float lowerQ;
-		if (final.size() % 2)
-		{
-			median = (final[ceil(final.size() / 2)] + final[floor(final.size() / 2)]) / 2;
-			vector<float> upperSet(final.size() / 2);
-			vector<float> lowerSet(final.size() / 2);
-			for (int i = 0; i < upperSet.size(); i++) {
-				lowerSet[i] = final[i];
-				upperSet[i] = final[i + upperSet.size()];
-			}
-			if (upperSet.size() % 2)
-			{
-				upperQ = (upperSet[ceil(upperSet.size() / 2)] + upperSet[floor(upperSet.size() / 2)]) / 2;
-				lowerQ = (lowerSet[ceil(upperSet.size() / 2)] + lowerSet[floor(lowerSet.size() / 2)]) / 2;
+		//create a queue to which we will push commands for the device
+		//commands are ordered by their event wait lists, so the queue runs them out of order when the device allows it
+		cl_command_queue_properties queue_properties = CL_QUEUE_PROFILING_ENABLE | (device.getInfo<CL_DEVICE_QUEUE_PROPERTIES>() & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE);
+		cl::CommandQueue queue(context, queue_properties);
+		cout << "Command queue: " << ((queue_properties & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE) ? "out of order" : "in order") << endl;
+
+		//lists larger than one run are sorted out of core, see outOfCoreSort
+		size_t run_records = run_mb > 0 ? (run_mb << 20) / sizeof(float) : deviceRunRecords(device);
+		size_t run_pow2 = 1;
+		while (run_pow2 * 2 <= run_records)
+			run_pow2 *= 2;
+
+		//load data into columns, from the binary cache when it is up to date
+		//the loader parses the temperatures straight into memory the device can read, see allocateTemps, unless
+		//they are to be sorted out of core, which keeps them in plain host memory and uploads a run at a time
+		//streaming parses the file chunk by chunk later on instead
+		TempDataset data;
+		DeviceTemps temps;
+		temps.zero_copy = SharesHostMemory(device);
+		if (stream_mb == 0) {
+			cout << "Dataset memory: " << (temps.zero_copy ? "shared with the device (zero copy)" : "pinned staging") << endl;
+			if (!loadDataset(data_path, data, [&](size_t n) { return show_sorted && !tune && n > run_pow2 ? nullptr : allocateTemps(context, queue, temps, n); }))
+				return 1;
+		}
 
+		//the binary cache keeps one specialised build per set of options
+		string build_options = buildOptions(device, local_size, vector_width, vector_items, fp64);
 
-			}
-			else
-			{
-				upperQ = upperSet[(upperSet.size() + 1) / 2];
-				lowerQ = lowerSet[(lowerSet.size() + 1) / 2];
+		//load & build the device code, reusing the binary from an earlier run when nothing has changed
+		cl::Program program;
+		try {
+			auto build_start = chrono::high_resolution_clock::now();
+			bool cached_binary = BuildProgramCached(context, "kernels/my_kernels.cl", build_options, program);
+			auto build_end = chrono::high_resolution_clock::now();
+			cout << "Kernel build time [ms]: " << chrono::duration_cast<chrono::milliseconds>(build_end - build_start).count() << (cached_binary ? " (cached)" : "") << endl;
+		}
+		catch (const cl::Error& err) {
+			cout << "Build Status: " << program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << endl;
+			cout << "Build Options:\t" << program.getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << endl;
+			cout << "Build Log:\t " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << endl;
+			throw err;
+		}
 
+		//set precision so decimals are shown on large numbers
+		cout.precision(10);
 
+		if (stream_mb > 0) {
+			//a separate in order queue for the uploads lets them run alongside the statistics kernels
+			cl::CommandQueue transfer_queue(context, CL_QUEUE_PROFILING_ENABLE);
+			StreamedStats streamed;
+			try {
+				streamed = streamStats(context, transfer_queue, queue, program, data_path, stream_mb << 20, local_size, vector_width, vector_items, fp64);
 			}
-			
-		}
-		else
-		{
-			median = final[(final.size() + 1) / 2];
-			vector<float> upperSet((final.size()-1) / 2);
-			vector<float> lowerSet((final.size() -1)/ 2);
-			for (int i = 0; i < upperSet.size(); i++) {
-				lowerSet[i] = final[i];
-				upperSet[i] = final[i + upperSet.size()+1];
+			catch (const runtime_error& err) {
+				cerr << "ERROR: " << err.what() << endl;
+				return 1;
 			}
-			if (upperSet.size() % 2)
-			{
-				upperQ = (upperSet[ceil(upperSet.size() / 2)] + upperSet[floor(upperSet.size() / 2)]) / 2;
-				lowerQ = (lowerSet[ceil(upperSet.size() / 2)] + lowerSet[floor(lowerSet.size() / 2)]) / 2;
+			cout << "Total size of dataset = " << streamed.records << endl;
+			if (streamed.records == 0) {
+				cerr << "ERROR: " << data_path << " holds no records" << endl;
+				return 1;
+			}
+			printStats(streamed.stats, streamed.min_record, streamed.max_record);
+			cout << "Quartiles need the whole dataset and are not calculated when streaming" << endl;
+			return 0;
+		}
 
+		//upload the temperatures once, every kernel below reads them from this buffer
+		//an out of core sort uploads them a run at a time instead and calculates the statistics as it goes
+		bool out_of_core = show_sorted && !tune && data.size() > run_pow2;
+		vector<cl::Event> uploaded;
+		if (!out_of_core) {
+			uploaded.assign(1, uploadTemps(context, queue, temps, data));
+		}
+		else if (hybrid) {
+			cerr << "Warning: the dataset is sorted out of core, so the statistics stay on the device run by run without -b" << endl;
+			hybrid = false;
+		}
 
+		if (tune) {
+			uploaded[0].wait();
+			Tuning best = tuneStats(context, queue, device, temps, fused_stats, sequential_sums, fp64);
+			if (best.local_size > 0) {
+				saveTuning(tuningKey(device), statsPathName(fused_stats, sequential_sums), best);
+				cout << "\nFastest work group size " << best.local_size << ", vector width " << best.vector_width << " and vectors per work item " << best.vector_items << " saved to " << TUNING_FILE << endl;
 			}
-			else
-			{
-				upperQ = upperSet[(upperSet.size() + 1) / 2];
-				lowerQ = lowerSet[(lowerSet.size() + 1) / 2];
+			return 0;
+		}
 
+		//a hybrid run gives the device the records from the start of the data up to its share and the CPU the rest
+		DeviceTemps stats_temps = temps;
+		if (hybrid) {
+			uploaded[0].wait();
+			double share = hybridShare(context, queue, program, temps, data.temp, local_size, vector_width, vector_items, fused_stats, sequential_sums, fp64);
+			//the device keeps at least one record so its kernels always have something to summarise
+			stats_temps.size = max((size_t)(share * data.size()), min(data.size(), (size_t)1));
+			cout << "Hybrid split: " << stats_temps.size << " records on the device, " << data.size() - stats_temps.size << " on the CPU (" << share * 100.0 << "% device)" << endl;
+		}
 
+		//queue the statistics and the quartiles as two branches that both only wait for the upload
+		RunStats queue_stats = [&](DeviceTemps& stats_of, const vector<cl::Event>& after) {
+			if (fused_stats)
+				return fusedStats(context, queue, program, stats_of, local_size, vector_width, vector_items, fp64, after);
+			return splitStats(context, queue, program, stats_of, local_size, sequential_sums, vector_width, vector_items, fp64, after);
+		};
+		function<StatsAccumulator()> stats_result;
+		if (!out_of_core)
+			stats_result = queue_stats(stats_temps, uploaded);
+
+		//the quartiles come from the sorted list when one is asked for and from radix select otherwise
+		//lists larger than one run are sorted out of core once the rest of the work is done
+		vector<size_t> ranks = quartileRanks(data.size());
+		function<vector<float>()> sort_result;
+		function<vector<float>()> select_result;
+		if (show_sorted && !out_of_core) {
+			if (radix_sort) {
+				sort_result = radixSort(context, queue, program, temps, local_size, uploaded);
+			}
+			else {
+				sort_result = bitonicSort(context, queue, program, temps, local_size, uploaded);
 			}
 		}
-		
+		else if (!show_sorted) {
+			select_result = radixSelect(context, queue, program, temps, local_size, ranks, uploaded);
+		}
+
+		//the CPU share of a hybrid run is summarised while the device works through its queue
+		StatsAccumulator cpu_stats;
+		if (hybrid) {
+			queue.flush();
+			auto cpu_start = chrono::high_resolution_clock::now();
+			cpu_stats = nativeStats(data.temp + stats_temps.size, data.size() - stats_temps.size);
+			auto cpu_end = chrono::high_resolution_clock::now();
+			cout << "Native statistics [ns]: " << chrono::duration_cast<chrono::nanoseconds>(cpu_end - cpu_start).count() << endl;
+		}
+
+		//the only point the host waits for the device, an out of core sort waits for each run as well
+		queue.finish();
+		Stats stats;
+		vector<float> rank_values(ranks.size());
+		if (out_of_core) {
+			StatsAccumulator total;
+			vector<float> sorted = outOfCoreSort(context, queue, program, data.temp, data.size(), run_pow2, local_size, radix_sort, queue_stats, total);
+			stats = total.result();
+			cout << "Sorted List" << sorted << endl;
+			for (size_t i = 0; i < ranks.size(); i++)
+				rank_values[i] = sorted[ranks[i]];
+		}
+		else {
+			cout << "Dataset upload [ns]: " << uploaded[0].getProfilingInfo<CL_PROFILING_COMMAND_END>() - uploaded[0].getProfilingInfo<CL_PROFILING_COMMAND_START>() << endl << endl;
+			stats = hybrid ? mergeHybrid(stats_result(), stats_temps.size, cpu_stats) : stats_result().result();
+		}
+		if (show_sorted && !out_of_core) {
+			vector<float> sorted = sort_result();
+			cout << "Sorted List" << sorted << endl;
+			for (size_t i = 0; i < ranks.size(); i++)
+				rank_values[i] = sorted[ranks[i]];
+		}
+		else if (!show_sorted) {
+			rank_values = select_result();
+		}
+		Quartiles quartiles = quartilesFromRanks(data.size(), rank_values);
+
 		//output stats
-		cout << "\n\nMean = " << mean_val << endl;
-		cout << "Max = " << max_val << endl;
-		cout << "Min = " << min_val << endl;
-		cout << "Varience = " << variance_value << endl;
-		cout << "Standard Deviation = " << standard_deviation_val << endl;
-		cout << "1st Quartile = " << lowerQ << endl;
-		cout <<"Meadian = " << median << endl;
-		cout << "3rd Quatile = " << upperQ << endl;
+		printStats(stats, describeRecord(data, stats.min_index), describeRecord(data, stats.max_index));
+		printQuartiles(quartiles);
 
 	}
 	//catch any errors produced by OpenCL API
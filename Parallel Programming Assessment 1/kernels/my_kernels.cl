@@ -1,173 +1,834 @@
-//enable use of long for large dataset
+//work group size of the statistics kernels, set by the host with -DGROUP_SIZE so the reduction loops have constant
+//trip counts the compiler can unroll; without it the kernels read the size at run time and accept any work group
+#ifdef GROUP_SIZE
+#define LOCAL_SIZE GROUP_SIZE
+#define FIXED_GROUP __attribute__((reqd_work_group_size(GROUP_SIZE, 1, 1)))
+#else
+#define LOCAL_SIZE get_local_size(0)
+#define FIXED_GROUP
+#endif
+
+//type of the running sums of the mean and variance kernels and of the mean and m2 of the fused partials, double when
+//the host sets -DUSE_FP64 on a device with cl_khr_fp64 and float otherwise; the temperatures are always read as floats
+#ifdef USE_FP64
 #pragma OPENCL EXTENSION cl_khr_fp64 : enable
-#pragma OPENCL EXTENSION cl_khr_int64_base_atomics : enable
+typedef double sum_t;
+#define SUM_TYPE double
+#else
+typedef float sum_t;
+#define SUM_TYPE float
+#endif
+
+//compensated addition of x to sum (Kahan-Babuska), the rounding error of every add is collected in c so that
+//sum + c is the sum to within one rounding; Knuth's two-sum finds the error without a branch on which operand is larger
+void kahan_add(sum_t* sum, sum_t* c, sum_t x) {
+	sum_t t = *sum + x;
+	sum_t b = t - *sum;
+	*c += (*sum - (t - b)) + (x - b);
+	*sum = t;
+}
 
-//calculates the sum of the input
-kernel void meanf(global const float* A, global int* B, local float* scratch) {
+//calculates the sum of each work group's part of the N inputs
+//writes one partial sum per work group to B, which reduce_sum then adds up
+kernel FIXED_GROUP void meanf(global const float* A, int N, global sum_t* B, local sum_t* scratch) {
 	int id = get_global_id(0);
 	int lid = get_local_id(0);
-	int N = get_local_size(0);
+	int L = LOCAL_SIZE;
 
-	//cache all N values from global memory to local memory
-	//multiply by 10 to turn all decimals in ints so no data is lossed when using atomic_add
-	scratch[lid] = A[id]*10.0f;
+	//cache all L values from global memory to local memory, items past N add 0
+	scratch[lid] = id < N ? A[id] : 0.0f;
 	barrier(CLK_LOCAL_MEM_FENCE);//wait for all local threads to finish copying from global to local memory
 	//partial sum for work group
-	for (int i = 1; i < N; i *= 2) {
-		if (!(lid % (i * 2)) && ((lid + i) < N)) 
+	for (int i = 1; i < L; i *= 2) {
+		if (!(lid % (i * 2)) && ((lid + i) < L)) 
 			scratch[lid] += scratch[lid + i];
 		barrier(CLK_LOCAL_MEM_FENCE);
 	}
 
-	//we add results from all local groups to the first element of the array
-	//serial operation! but works for any group size
-	//copy the cache to output array
+	//each work group writes its own partial so no two groups touch the same address
 	if (lid == 0) {
-		int intVal = convert_int(scratch[lid]);
-		atomic_add(&B[0],intVal);
+		B[get_group_id(0)] = scratch[0];
+	}
+}
+
+//width of a lockstep wavefront, set by the host with -DWAVEFRONT_SIZE only when it is safe to drop barriers
+//for the last steps of a reduction (a power of two work group of at least twice this size)
+#ifndef WAVEFRONT_SIZE
+#define WAVEFRONT_SIZE 0
+#endif
+
+//sequential addressing tree sum of scratch[0..L), leaving the total in scratch[0]
+//active work items stay contiguous at the bottom of the group and the stride halves each step,
+//so there is no modulo, no divergence inside a wavefront and no local memory bank conflicts
+//adding neighbours level by level is a pairwise sum, so its rounding error only grows with log2(L)
+void reduce_local_sum(local sum_t* scratch, int lid, int L) {
+	int stride = 1;
+	while (stride < L)
+		stride *= 2;
+#if WAVEFRONT_SIZE > 0
+	for (stride /= 2; stride > WAVEFRONT_SIZE; stride /= 2) {
+		if (lid < stride)
+			scratch[lid] += scratch[lid + stride];
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	//the last wavefront executes in lockstep so its steps are unrolled without barriers
+	if (lid < WAVEFRONT_SIZE) {
+		volatile local sum_t* wave = scratch;
+#pragma unroll
+		for (int s = WAVEFRONT_SIZE; s > 0; s /= 2)
+			wave[lid] += wave[lid + s];
+	}
+#else
+	for (stride /= 2; stride > 0; stride /= 2) {
+		if (lid < stride && lid + stride < L)
+			scratch[lid] += scratch[lid + stride];
+		barrier(CLK_LOCAL_MEM_FENCE);
 	}
+#endif
+}
+
+//sequential addressing version of meanf, each work group sums 2 * L elements of the N inputs
+//the first add is done while loading from global memory so only half as many work groups are needed
+kernel FIXED_GROUP void meanf_seq(global const float* A, int N, global sum_t* B, local sum_t* scratch) {
+	int lid = get_local_id(0);
+	int L = LOCAL_SIZE;
+	int id = get_group_id(0) * L * 2 + lid;
+
+	sum_t sum = 0.0f;
+	if (id < N)
+		sum = A[id];
+	if (id + L < N)
+		sum += A[id + L];
+	scratch[lid] = sum;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	reduce_local_sum(scratch, lid, L);
+	if (lid == 0)
+		B[get_group_id(0)] = scratch[0];
+}
+
+//second stage of a sum reduction, run as a single work group
+//each work item adds up a strided slice of the N partials with compensation before the local tree reduction
+//the total is multiplied by scale before it is written, so a scale of 1 / n leaves the mean on the device
+kernel FIXED_GROUP void reduce_sum(global const sum_t* A, int N, global sum_t* B, sum_t scale, local sum_t* scratch) {
+	int lid = get_local_id(0);
+	int L = LOCAL_SIZE;
+
+	sum_t sum = 0.0f;
+	sum_t c = 0.0f;
+	for (int i = lid; i < N; i += L)
+		kahan_add(&sum, &c, A[i]);
+	scratch[lid] = sum + c;
 	barrier(CLK_LOCAL_MEM_FENCE);
-	
+
+	reduce_local_sum(scratch, lid, L);
+	if (lid == 0)
+		B[0] = scratch[0] * scale;
 }
 
-//calculates partial maxes and mins of array
-kernel void maxminf(global const float* A, global float* B, global float* C, local float* scratch) {
+//partial statistics of a block of the input
+//m2 is the sum of squared differences from the block mean, so variance = m2 / count
+typedef struct {
+	uint count;
+	sum_t mean;
+	sum_t m2;
+	float min;
+	float max;
+	int min_index;
+	int max_index;
+} stats_t;
+
+//merges two partials with Chan's parallel update of the mean and m2
+stats_t stats_merge(stats_t a, stats_t b) {
+	if (b.count == 0)
+		return a;
+	if (a.count == 0)
+		return b;
+	stats_t r;
+	r.count = a.count + b.count;
+	sum_t delta = b.mean - a.mean;
+	sum_t weight = (sum_t)b.count / (sum_t)r.count;
+	r.mean = a.mean + delta * weight;
+	r.m2 = a.m2 + b.m2 + delta * delta * (sum_t)a.count * weight;
+	//ties go to the lower index so the earliest record is reported, as in minmax_merge
+	bool b_min = b.min < a.min || (b.min == a.min && b.min_index < a.min_index);
+	bool b_max = b.max > a.max || (b.max == a.max && b.max_index < a.max_index);
+	r.min = b_min ? b.min : a.min;
+	r.min_index = b_min ? b.min_index : a.min_index;
+	r.max = b_max ? b.max : a.max;
+	r.max_index = b_max ? b.max_index : a.max_index;
+	return r;
+}
+
+//partial with no elements, which every merge leaves unchanged
+stats_t stats_empty() {
+	stats_t s;
+	s.count = 0;
+	s.mean = 0.0f;
+	s.m2 = 0.0f;
+	s.min = INFINITY;
+	s.max = -INFINITY;
+	s.min_index = INT_MAX;
+	s.max_index = INT_MAX;
+	return s;
+}
+
+//partial of the single element x at index i
+stats_t stats_single(float x, int i) {
+	stats_t s;
+	s.count = 1;
+	s.mean = x;
+	s.m2 = 0.0f;
+	s.min = x;
+	s.max = x;
+	s.min_index = i;
+	s.max_index = i;
+	return s;
+}
+
+//tree reduction of scratch[0..L) with the stride halving each step, starting from the power of two at or above L / 2
+//leaves the merged partial of the work group in scratch[0]
+void reduce_local_stats(local stats_t* scratch, int lid, int L) {
+	int stride = 1;
+	while (stride < L)
+		stride *= 2;
+	for (stride /= 2; stride > 0; stride /= 2) {
+		if (lid < stride && lid + stride < L)
+			scratch[lid] = stats_merge(scratch[lid], scratch[lid + stride]);
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+}
+
+//calculates count, mean, m2, min and max (with their indices) of each work group in one pass over the input
+//items past N contribute an empty partial so the input needs no padding
+kernel FIXED_GROUP void stats_fused(global const float* A, int N, global stats_t* B, local stats_t* scratch) {
 	int id = get_global_id(0);
 	int lid = get_local_id(0);
-	int N = get_local_size(0);
+	int L = LOCAL_SIZE;
 
-	
-	//cache all N values from global memory to local memory
-	scratch[lid] = A[id];
+	//read each element once and turn it into a single element partial
+	stats_t s = id < N ? stats_single(A[id], id) : stats_empty();
+	scratch[lid] = s;
 	barrier(CLK_LOCAL_MEM_FENCE);//wait for all local threads to finish copying from global to local memory
-	//calculate partial max and min
-	if (lid == 0){
-		float max = scratch[lid];
-		float min = scratch[lid];
-	
-		for (int i = 1; i < N; i++)
-		{
-			if (scratch[i] > max){
-				max = scratch[i];
-			}
-			if (scratch[i] < min){
-				min = scratch[i];
-			}
-		}
-		B[get_group_id(0)] = max;
-		C[get_group_id(0)] = min;
+
+	reduce_local_stats(scratch, lid, L);
+
+	//one partial per work group, merged by the host
+	if (lid == 0)
+		B[get_group_id(0)] = scratch[0];
+}
+
+//smallest and largest value of a block of the input with the global index of each
+//blocks with no elements hold +/-INFINITY and index INT_MAX so they never win a comparison
+typedef struct {
+	float min;
+	float max;
+	int min_index;
+	int max_index;
+} minmax_t;
+
+//keeps the smaller min and larger max of two blocks, ties go to the lower index so the earliest record wins
+minmax_t minmax_merge(minmax_t a, minmax_t b) {
+	if (b.min < a.min || (b.min == a.min && b.min_index < a.min_index)) {
+		a.min = b.min;
+		a.min_index = b.min_index;
+	}
+	if (b.max > a.max || (b.max == a.max && b.max_index < a.max_index)) {
+		a.max = b.max;
+		a.max_index = b.max_index;
+	}
+	return a;
+}
+
+//calculates partial max and min of scratch[0..L), halving the number of active work items each step
+//leaves the merged partial of the work group in scratch[0]
+void reduce_local_minmax(local minmax_t* scratch, int lid, int L) {
+	int stride = 1;
+	while (stride < L)
+		stride *= 2;
+	for (stride /= 2; stride > 0; stride /= 2) {
+		if (lid < stride && lid + stride < L)
+			scratch[lid] = minmax_merge(scratch[lid], scratch[lid + stride]);
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+}
+
+//calculates partial maxes and mins of array along with where in the array they are
+//min and max are found together with a sequential addressing tree reduction, items past N are ignored
+kernel FIXED_GROUP void maxminf(global const float* A, int N, global minmax_t* B, local minmax_t* scratch) {
+	int id = get_global_id(0);
+	int lid = get_local_id(0);
+	int L = LOCAL_SIZE;
+
+	//cache all N values from global memory to local memory
+	minmax_t m;
+	if (id < N) {
+		m.min = A[id];
+		m.max = m.min;
+		m.min_index = id;
+		m.max_index = id;
 	}
+	else {
+		m.min = INFINITY;
+		m.max = -INFINITY;
+		m.min_index = INT_MAX;
+		m.max_index = INT_MAX;
+	}
+	scratch[lid] = m;
+	barrier(CLK_LOCAL_MEM_FENCE);//wait for all local threads to finish copying from global to local memory
+
+	reduce_local_minmax(scratch, lid, L);
 
+	//one partial per work group, merged by the host
+	if (lid == 0)
+		B[get_group_id(0)] = scratch[0];
 }
 
 
 //calculate squared difference
-kernel void variance(global const float* A, global long* B, global float* mean, local float* scratch) {
+//writes one partial sum of squared differences per work group to B, which reduce_sum then adds up
+kernel FIXED_GROUP void variance(global const float* A, int N, global sum_t* B, global sum_t* mean, local sum_t* scratch) {
 	int id = get_global_id(0);
 	int lid = get_local_id(0);
-	int N = get_local_size(0);
-	////calculate each squared difference and store in local memory
-	float diff = A[id] - mean[0];
-	float power = convert_float(pow(diff, 2.0f));
-	scratch[lid] = power * 100.0f;//multiply by 100 to preserve decimals when converting to int
+	int L = LOCAL_SIZE;
+	//calculate each squared difference and store in local memory, items past N add 0
+	sum_t diff = id < N ? A[id] - mean[0] : 0.0f;
+	scratch[lid] = diff * diff;
 	barrier(CLK_LOCAL_MEM_FENCE);//wait for all local threads to finish copying from global to local memory
 	//calculate partial sums
-	for (int i = 1; i < N; i *= 2) {
-		if (!(lid % (i * 2)) && ((lid + i) < N)) 
+	for (int i = 1; i < L; i *= 2) {
+		if (!(lid % (i * 2)) && ((lid + i) < L)) 
 			scratch[lid] += scratch[lid + i];
 		barrier(CLK_LOCAL_MEM_FENCE);
 	}
-	barrier(CLK_LOCAL_MEM_FENCE);
-	////we add results from all local groups to the first element of the array
-	////serial operation! but works for any group size
-	////copy the cache to output array
+
+	//each work group writes its own partial so no two groups touch the same address
 	if (lid == 0) {
-		long intVal = convert_long(scratch[lid]);
-		atom_add(&B[0],intVal);
+		B[get_group_id(0)] = scratch[0];
 	}
+}
+
+//sequential addressing version of variance, each work group sums the squared differences of 2 * L elements
+kernel FIXED_GROUP void variance_seq(global const float* A, int N, global sum_t* B, global sum_t* mean, local sum_t* scratch) {
+	int lid = get_local_id(0);
+	int L = LOCAL_SIZE;
+	int id = get_group_id(0) * L * 2 + lid;
+	sum_t m = mean[0];
+
+	sum_t sum = 0.0f;
+	if (id < N)
+		sum = (A[id] - m) * (A[id] - m);
+	if (id + L < N)
+		sum += (A[id + L] - m) * (A[id + L] - m);
+	scratch[lid] = sum;
 	barrier(CLK_LOCAL_MEM_FENCE);
+
+	reduce_local_sum(scratch, lid, L);
+	if (lid == 0)
+		B[get_group_id(0)] = scratch[0];
+}
+
+//vectorised grid stride versions of the statistics kernels
+//each work item loads VECTOR_WIDTH elements at a time with vloadN and strides over the input by the global size,
+//so CPU devices get whole SIMD registers and GPUs wide memory transactions; the N % VECTOR_WIDTH elements after
+//the last whole vector are read one at a time with the same stride, so no padding is needed
+//the host sets VECTOR_WIDTH from CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT and only uses these kernels when it is above 1
+#ifndef VECTOR_WIDTH
+#define VECTOR_WIDTH 4
+#endif
+#define VEC_JOIN(a, b) a##b
+#define VEC_NAME(a, b) VEC_JOIN(a, b)
+#define floatN VEC_NAME(float, VECTOR_WIDTH)
+#define intN VEC_NAME(int, VECTOR_WIDTH)
+#define vloadN VEC_NAME(vload, VECTOR_WIDTH)
+#define vstoreN VEC_NAME(vstore, VECTOR_WIDTH)
+#define sumN VEC_NAME(SUM_TYPE, VECTOR_WIDTH)
+#define convert_sumN VEC_NAME(convert_, sumN)
+
+//vectors each work item loads per grid stride, set by the host with -DVECTOR_ITEMS and used to size the grid
+//the inner loop has a fixed trip count so it unrolls and the loads of one stride can be in flight together,
+//while v still visits id, id + global size, ... in order so the results do not depend on it
+#ifndef VECTOR_ITEMS
+#define VECTOR_ITEMS 4
+#endif
+#define FOR_VECTORS(v) for (int v##_base = id; v##_base < vectors; v##_base += VECTOR_ITEMS * get_global_size(0)) \
+	for (int v##_item = 0, v = v##_base; v##_item < VECTOR_ITEMS && v < vectors; v##_item++, v += get_global_size(0))
+
+//lane numbers, loaded as a vector to give every lane of a load the index of its element
+constant int lane_ids[16] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 };
+
+//kahan_add on every lane of a vector
+void kahan_add_vec(sumN* sum, sumN* c, sumN x) {
+	sumN t = *sum + x;
+	sumN b = t - *sum;
+	*c += (*sum - (t - b)) + (x - b);
+	*sum = t;
 }
 
-//compare and exchange values 
-void cmpxchg(global float* A, global float* B, bool dir) {
-	if ((!dir && *A > *B) || (dir && *A < *B)) {
-		float t = *A;
-		*A = *B;
-		*B = t;
+//adds the lanes of the compensated vector sum (sum, c) into the compensated sum (total, total_c)
+void add_lanes(sumN sum, sumN c, sum_t* total, sum_t* total_c) {
+	sum_t sums[VECTOR_WIDTH];
+	sum_t cs[VECTOR_WIDTH];
+	vstoreN(sum, 0, sums);
+	vstoreN(c, 0, cs);
+	for (int i = 0; i < VECTOR_WIDTH; i++) {
+		kahan_add(total, total_c, sums[i]);
+		*total_c += cs[i];
 	}
 }
 
+//vectorised meanf, writes one partial sum per work group to B
+//every lane and the tail keep a compensated sum, as each work item adds up many elements
+kernel FIXED_GROUP void meanf_vec(global const float* A, int N, global sum_t* B, local sum_t* scratch) {
+	int id = get_global_id(0);
+	int lid = get_local_id(0);
+	int L = LOCAL_SIZE;
+	int vectors = N / VECTOR_WIDTH;
 
+	sumN sum = 0.0f;
+	sumN c = 0.0f;
+	FOR_VECTORS(v)
+		kahan_add_vec(&sum, &c, convert_sumN(vloadN(v, A)));
+	sum_t total = 0.0f;
+	sum_t total_c = 0.0f;
+	add_lanes(sum, c, &total, &total_c);
+	for (int tail = vectors * VECTOR_WIDTH + id; tail < N; tail += get_global_size(0))
+		kahan_add(&total, &total_c, A[tail]);
+	scratch[lid] = total + total_c;
+	barrier(CLK_LOCAL_MEM_FENCE);
 
-//create bitonic stage 0
-kernel void bitonic_initial(global float* A){
+	reduce_local_sum(scratch, lid, L);
+	if (lid == 0)
+		B[get_group_id(0)] = scratch[0];
+}
+
+//vectorised variance, writes one partial sum of squared differences per work group to B
+kernel FIXED_GROUP void variance_vec(global const float* A, int N, global sum_t* B, global sum_t* mean, local sum_t* scratch) {
 	int id = get_global_id(0);
-	//compare pairs of values and alternate direction 
-	if (id/2 % 2 == 0){
-		cmpxchg(&A[id],&A[id+1],false);
-	}
-	else if (id % 2 == 0){
-		cmpxchg(&A[id],&A[id+1],true);
-	}
-	barrier(CLK_GLOBAL_MEM_FENCE);
-	
-}
-
-//calculate intermidiate stage n
-kernel void bitonic_nmerge(global float* A, global int* stage){
-	int gs = get_global_size(0);
-	//calculate the number of bitonic sequences for current stage
-	float base = 2.0;
-	int stride = convert_int(pown(base, stage[0]));
-	int numBitonicGroups = gs / (stride * 4);
-	int N = gs / numBitonicGroups;
-	
+	int lid = get_local_id(0);
+	int L = LOCAL_SIZE;
+	int vectors = N / VECTOR_WIDTH;
+	sum_t m = mean[0];
+
+	sumN sum = 0.0f;
+	sumN c = 0.0f;
+	FOR_VECTORS(v) {
+		sumN diff = convert_sumN(vloadN(v, A)) - m;
+		kahan_add_vec(&sum, &c, diff * diff);
+	}
+	sum_t total = 0.0f;
+	sum_t total_c = 0.0f;
+	add_lanes(sum, c, &total, &total_c);
+	for (int tail = vectors * VECTOR_WIDTH + id; tail < N; tail += get_global_size(0))
+		kahan_add(&total, &total_c, (A[tail] - m) * (A[tail] - m));
+	scratch[lid] = total + total_c;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	reduce_local_sum(scratch, lid, L);
+	if (lid == 0)
+		B[get_group_id(0)] = scratch[0];
+}
+
+//vectorised maxminf, every lane keeps its own min and max with their indices until the lanes are merged
+//a lane sees its elements in increasing index order, so strict comparisons keep the earliest of equal values
+kernel FIXED_GROUP void maxminf_vec(global const float* A, int N, global minmax_t* B, local minmax_t* scratch) {
 	int id = get_global_id(0);
-	bool dir = false;
-	barrier(CLK_GLOBAL_MEM_FENCE);
-	//sort each bitonic sequence in the stage into either ascending or descending or to create larger bitonic sequnces
-	if (get_global_id(0)/(gs/(numBitonicGroups)) % 2 == 0 && get_global_id(0) % (gs/(numBitonicGroups)) == 0){
-		for (int i = N/2; i > 0; i/=2) {
-			for (int j = 0; j < N-i; j++){
-				if ((id % (i*2)) < i)
-				{
-					cmpxchg(&A[j+id],&A[j+i+id],dir);
-				}
-			}
-		}
+	int lid = get_local_id(0);
+	int L = LOCAL_SIZE;
+	int vectors = N / VECTOR_WIDTH;
+	intN lanes = vloadN(0, lane_ids);
+
+	floatN lane_min = INFINITY;
+	floatN lane_max = -INFINITY;
+	intN min_index = INT_MAX;
+	intN max_index = INT_MAX;
+	FOR_VECTORS(v) {
+		floatN x = vloadN(v, A);
+		intN index = lanes + v * VECTOR_WIDTH;
+		intN lower = isless(x, lane_min);
+		intN higher = isgreater(x, lane_max);
+		lane_min = select(lane_min, x, lower);
+		min_index = select(min_index, index, lower);
+		lane_max = select(lane_max, x, higher);
+		max_index = select(max_index, index, higher);
+	}
+
+	//merge the lanes and then the tail element
+	float mins[VECTOR_WIDTH];
+	float maxs[VECTOR_WIDTH];
+	int min_ids[VECTOR_WIDTH];
+	int max_ids[VECTOR_WIDTH];
+	vstoreN(lane_min, 0, mins);
+	vstoreN(lane_max, 0, maxs);
+	vstoreN(min_index, 0, min_ids);
+	vstoreN(max_index, 0, max_ids);
+	minmax_t m = { INFINITY, -INFINITY, INT_MAX, INT_MAX };
+	for (int i = 0; i < VECTOR_WIDTH; i++) {
+		minmax_t lane = { mins[i], maxs[i], min_ids[i], max_ids[i] };
+		m = minmax_merge(m, lane);
+	}
+	for (int tail = vectors * VECTOR_WIDTH + id; tail < N; tail += get_global_size(0)) {
+		minmax_t t = { A[tail], A[tail], tail, tail };
+		m = minmax_merge(m, t);
+	}
+	scratch[lid] = m;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	reduce_local_minmax(scratch, lid, L);
+	if (lid == 0)
+		B[get_group_id(0)] = scratch[0];
+}
+
+//vectorised stats_fused, every lane keeps a running Welford mean and m2 in sum_t alongside its min and max
+//all lanes see the same number of elements so the count is shared, the lanes are merged with stats_merge
+kernel FIXED_GROUP void stats_fused_vec(global const float* A, int N, global stats_t* B, local stats_t* scratch) {
+	int id = get_global_id(0);
+	int lid = get_local_id(0);
+	int L = LOCAL_SIZE;
+	int vectors = N / VECTOR_WIDTH;
+	intN lanes = vloadN(0, lane_ids);
+
+	uint count = 0;
+	sumN mean = 0.0f;
+	sumN m2 = 0.0f;
+	floatN lane_min = INFINITY;
+	floatN lane_max = -INFINITY;
+	intN min_index = INT_MAX;
+	intN max_index = INT_MAX;
+	FOR_VECTORS(v) {
+		floatN x = vloadN(v, A);
+		intN index = lanes + v * VECTOR_WIDTH;
+		count++;
+		sumN xs = convert_sumN(x);
+		sumN delta = xs - mean;
+		mean += delta / (sum_t)count;
+		m2 += delta * (xs - mean);
+		intN lower = isless(x, lane_min);
+		intN higher = isgreater(x, lane_max);
+		lane_min = select(lane_min, x, lower);
+		min_index = select(min_index, index, lower);
+		lane_max = select(lane_max, x, higher);
+		max_index = select(max_index, index, higher);
 	}
-	else if (get_global_id(0) % (gs/(numBitonicGroups)) == 0){
-		bool dir = true;
-		for (int i = N/2; i > 0; i/=2) {
-			for (int j = 0; j < N-i; j++){
-				if ((id % (i*2)) < i)
-				{
-					cmpxchg(&A[j+id],&A[j+i+id],dir);
-				}
-			}
+
+	//merge the lanes and then the tail element
+	sum_t means[VECTOR_WIDTH];
+	sum_t m2s[VECTOR_WIDTH];
+	float mins[VECTOR_WIDTH];
+	float maxs[VECTOR_WIDTH];
+	int min_ids[VECTOR_WIDTH];
+	int max_ids[VECTOR_WIDTH];
+	vstoreN(mean, 0, means);
+	vstoreN(m2, 0, m2s);
+	vstoreN(lane_min, 0, mins);
+	vstoreN(lane_max, 0, maxs);
+	vstoreN(min_index, 0, min_ids);
+	vstoreN(max_index, 0, max_ids);
+	stats_t s = stats_empty();
+	for (int i = 0; i < VECTOR_WIDTH; i++) {
+		stats_t lane = { count, means[i], m2s[i], mins[i], maxs[i], min_ids[i], max_ids[i] };
+		s = stats_merge(s, lane);
+	}
+	for (int tail = vectors * VECTOR_WIDTH + id; tail < N; tail += get_global_size(0))
+		s = stats_merge(s, stats_single(A[tail], tail));
+	scratch[lid] = s;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	reduce_local_stats(scratch, lid, L);
+	if (lid == 0)
+		B[get_group_id(0)] = scratch[0];
+}
+
+//bitonic sorting network over n = 2^m elements
+//stage k merges bitonic sequences of length k into sorted runs and runs passes with distance j = k / 2 down to 1
+//every pass compares n / 2 disjoint pairs (lo, lo + j), where lo is pair i with a zero bit inserted at the
+//position of j, and a pair is sorted ascending when bit k of its global position is clear and descending otherwise
+
+//index of the lower element of pair i in a pass of distance j
+int bitonic_lo(int i, int j) {
+	return 2 * i - (i & (j - 1));
+}
+
+//one pass of the network over global memory with one work item per pair, for distances too big for a work group
+kernel void bitonic_step(global float* A, int j, int k) {
+	int lo = bitonic_lo(get_global_id(0), j);
+	int hi = lo + j;
+	bool ascending = (lo & k) == 0;
+	float a = A[lo];
+	float b = A[hi];
+	if ((a > b) == ascending) {
+		A[lo] = b;
+		A[hi] = a;
+	}
+}
+
+//one pass of the network over the 2 * L elements of a work group held in local memory
+//offset is the global position of scratch[0], used to pick the direction of each pair
+void bitonic_local_pass(local float* scratch, int lid, int offset, int j, int k) {
+	int lo = bitonic_lo(lid, j);
+	int hi = lo + j;
+	bool ascending = ((offset + lo) & k) == 0;
+	float a = scratch[lo];
+	float b = scratch[hi];
+	if ((a > b) == ascending) {
+		scratch[lo] = b;
+		scratch[hi] = a;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+}
+
+//runs every stage that fits in a work group, each sorts its 2 * L elements in local memory
+//neighbouring blocks are sorted in opposite directions so together they form the bitonic input of the next stage
+kernel void bitonic_sort_local(global float* A, local float* scratch) {
+	int lid = get_local_id(0);
+	int L = get_local_size(0);
+	int offset = get_group_id(0) * L * 2;
+
+	//cache both elements of each pair from global memory to local memory
+	scratch[lid] = A[offset + lid];
+	scratch[lid + L] = A[offset + lid + L];
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int k = 2; k <= 2 * L; k *= 2) {
+		for (int j = k / 2; j > 0; j /= 2)
+			bitonic_local_pass(scratch, lid, offset, j, k);
+	}
+
+	A[offset + lid] = scratch[lid];
+	A[offset + lid + L] = scratch[lid + L];
+}
+
+//finishes stage k once its passes are short enough to stay inside a work group, fusing passes L down to 1
+kernel void bitonic_merge_local(global float* A, int k, local float* scratch) {
+	int lid = get_local_id(0);
+	int L = get_local_size(0);
+	int offset = get_group_id(0) * L * 2;
+
+	scratch[lid] = A[offset + lid];
+	scratch[lid + L] = A[offset + lid + L];
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int j = L; j > 0; j /= 2)
+		bitonic_local_pass(scratch, lid, offset, j, k);
+
+	A[offset + lid] = scratch[lid];
+	A[offset + lid + L] = scratch[lid + L];
+}
+
+//least significant digit radix sort of 32 bit keys, RADIX_BITS bits per pass starting from the bottom digit
+//each pass counts the digits of every tile of L keys (radix_histogram), turns the counts into output offsets with
+//an exclusive scan and moves every key to its place (radix_scatter); every pass is stable so after the top digit
+//the keys are fully sorted, and tiles past the end of the input are simply left out so no padding is needed
+#define RADIX_BITS 4
+#define RADIX (1 << RADIX_BITS)
+
+//maps float bits to a uint that sorts in the same order as the floats
+//negative values have every bit flipped so larger magnitudes come first, positive values only the sign bit
+uint float_key(uint b) {
+	return b ^ ((b >> 31) ? 0xFFFFFFFF : 0x80000000);
+}
+
+//replaces each float with its float_key in place
+kernel void float_to_key(global uint* A, int N) {
+	int id = get_global_id(0);
+	if (id < N)
+		A[id] = float_key(A[id]);
+}
+
+//inverse of float_to_key
+kernel void key_to_float(global uint* A, int N) {
+	int id = get_global_id(0);
+	if (id < N) {
+		uint b = A[id];
+		A[id] = b ^ ((b >> 31) ? 0x80000000 : 0xFFFFFFFF);
+	}
+}
+
+//counts the digits at shift in each work group's tile of the keys
+//the counts are stored digit major (hist[digit * groups + group]) so one exclusive scan of hist gives every
+//tile the position of its first key of each digit in the output of the pass
+kernel void radix_histogram(global const uint* A, int N, int shift, global uint* hist, local uint* counts) {
+	int id = get_global_id(0);
+	int lid = get_local_id(0);
+	int L = get_local_size(0);
+	int group = get_group_id(0);
+	int groups = get_num_groups(0);
+
+	for (int d = lid; d < RADIX; d += L)
+		counts[d] = 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (id < N)
+		atomic_inc(&counts[(A[id] >> shift) & (RADIX - 1)]);
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int d = lid; d < RADIX; d += L)
+		hist[d * groups + group] = counts[d];
+}
+
+//exclusive scan of one value per work item across the work group (Hillis and Steele)
+//returns the sum of the values of the work items before this one and sets total to the sum over the group
+uint local_exclusive_scan(uint value, local uint* scratch, int lid, int L, uint* total) {
+	scratch[lid] = value;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (int s = 1; s < L; s *= 2) {
+		uint t = lid >= s ? scratch[lid - s] : 0;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		scratch[lid] += t;
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	*total = scratch[L - 1];
+	uint prefix = scratch[lid] - value;
+	barrier(CLK_LOCAL_MEM_FENCE);//scratch is reused by the next call
+	return prefix;
+}
+
+//moves each key of a tile to its place in the output of the pass, offsets is the scanned histogram
+//the tile is first sorted by digit in local memory with one stable split per bit, after which the keys of each
+//digit are contiguous and in input order, so a key's output position is the tile's offset for its digit plus
+//its distance from the first key of that digit in the tile
+kernel void radix_scatter(global const uint* A, int N, global uint* B, int shift, global const uint* offsets,
+	local uint* keys, local uint* scan, local uint* starts) {
+	int lid = get_local_id(0);
+	int L = get_local_size(0);
+	int group = get_group_id(0);
+	int groups = get_num_groups(0);
+	int id = group * L + lid;
+	int tile = min(L, N - group * L);
+
+	//items past N take the largest key, they start at the end of the tile and the splits keep them there
+	uint key = id < N ? A[id] : 0xFFFFFFFF;
+	uint digit = (key >> shift) & (RADIX - 1);
+
+	//split on each bit of the digit, keys with the bit clear keep their order at the front, the rest after them
+	for (int b = 0; b < RADIX_BITS; b++) {
+		uint bit = (digit >> b) & 1;
+		uint zeros;
+		uint zeros_before = local_exclusive_scan(1 - bit, scan, lid, L, &zeros);
+		keys[bit ? zeros + lid - zeros_before : zeros_before] = key;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		key = keys[lid];
+		digit = (key >> shift) & (RADIX - 1);
+	}
+
+	//the first key of each digit records where that digit starts in the tile
+	if (lid == 0 || digit != ((keys[lid - 1] >> shift) & (RADIX - 1)))
+		starts[digit] = lid;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (lid < tile)
+		B[offsets[digit * groups + group] + lid - starts[digit]] = key;
+}
+
+//work efficient (Blelloch) exclusive scan of the 2 * L elements of each work group, in place
+//the total of each group is written to sums, which are scanned the same way and added back by scan_add
+//so any length can be scanned; L must be a power of two
+kernel void scan_exclusive(global uint* A, int N, global uint* sums, local uint* scratch) {
+	int lid = get_local_id(0);
+	int L = get_local_size(0);
+	int n = 2 * L;
+	int offset = get_group_id(0) * n;
+
+	scratch[lid] = offset + lid < N ? A[offset + lid] : 0;
+	scratch[lid + L] = offset + lid + L < N ? A[offset + lid + L] : 0;
+
+	//up sweep leaves the sum of each subtree in its last element
+	int d = 1;
+	for (int s = L; s > 0; s /= 2) {
+		barrier(CLK_LOCAL_MEM_FENCE);
+		if (lid < s)
+			scratch[d * (2 * lid + 2) - 1] += scratch[d * (2 * lid + 1) - 1];
+		d *= 2;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+	if (lid == 0) {
+		sums[get_group_id(0)] = scratch[n - 1];
+		scratch[n - 1] = 0;
+	}
+
+	//down sweep passes each prefix to the right subtree and the left subtree's total down to the left
+	for (int s = 1; s < n; s *= 2) {
+		d /= 2;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		if (lid < s) {
+			int left = d * (2 * lid + 1) - 1;
+			int right = d * (2 * lid + 2) - 1;
+			uint t = scratch[left];
+			scratch[left] = scratch[right];
+			scratch[right] += t;
 		}
 	}
-	
-	barrier(CLK_GLOBAL_MEM_FENCE);
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (offset + lid < N)
+		A[offset + lid] = scratch[lid];
+	if (offset + lid + L < N)
+		A[offset + lid + L] = scratch[lid + L];
+}
+
+//adds the scanned total of all earlier groups to each group's 2 * L elements of a scan_exclusive output
+kernel void scan_add(global uint* A, int N, global const uint* sums) {
+	int lid = get_local_id(0);
+	int L = get_local_size(0);
+	int offset = get_group_id(0) * 2 * L;
+	uint add = sums[get_group_id(0)];
+
+	if (offset + lid < N)
+		A[offset + lid] += add;
+	if (offset + lid + L < N)
+		A[offset + lid + L] += add;
 }
 
-//produce final sorted list
-kernel void bitonic_merge_final(global float* A){
+//radix select finds the keys at chosen ranks of the sorted input without sorting it
+//each pass fixes the next SELECT_BITS of every wanted key from the top down: the keys whose higher bits match a
+//rank's prefix are histogrammed on the next digit and the host picks the bucket holding the rank, so after
+//32 / SELECT_BITS passes each prefix is a whole key
+#define SELECT_BITS 8
+#define SELECT_RADIX (1 << SELECT_BITS)
+
+//histograms the digit at shift of the keys matching each of the count prefixes, bits below shift + SELECT_BITS
+//of the prefixes are ignored; hist holds SELECT_RADIX counts per prefix, zeroed by the host before the pass
+//each work group counts in local memory and adds its non-zero counts to hist with one atomic each
+kernel FIXED_GROUP void radix_select_histogram(global const float* A, int N, int shift, global const uint* prefixes, int count,
+	global uint* hist, local uint* counts) {
 	int id = get_global_id(0);
-	int N = get_global_size(0);
-	//perform the final bitonic merge to sort the list
-	if (id == 0){
-		bool dir = false;
-		barrier(CLK_GLOBAL_MEM_FENCE);
-		for (int i = N/2; i > 0; i/=2) {
-			for (int j = 0; j < get_global_size(0)-i; j++){
-				barrier(CLK_GLOBAL_MEM_FENCE);
-				if ((id % (i*2)) < i)
-				{
-					cmpxchg(&A[j],&A[j+i],dir);
-				}
-				barrier(CLK_GLOBAL_MEM_FENCE);
-			}
+	int lid = get_local_id(0);
+	int L = LOCAL_SIZE;
+
+	for (int i = lid; i < count * SELECT_RADIX; i += L)
+		counts[i] = 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (id < N) {
+		uint key = float_key(as_uint(A[id]));
+		uint mask = shift + SELECT_BITS < 32 ? 0xFFFFFFFF << (shift + SELECT_BITS) : 0;
+		uint digit = (key >> shift) & (SELECT_RADIX - 1);
+		for (int r = 0; r < count; r++) {
+			if ((key & mask) == prefixes[r])
+				atomic_inc(&counts[r * SELECT_RADIX + digit]);
 		}
 	}
-}
\ No newline at end of file
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int i = lid; i < count * SELECT_RADIX; i += L) {
+		if (counts[i])
+			atomic_add(&hist[i], counts[i]);
+	}
+}
+
+//moves each rank into the bucket of its histogram that holds it, one work item per rank
+//fixes the digit at shift of prefixes[r] and takes the keys in lower buckets off remaining[r], so the
+//select passes can follow each other on the device without the host reading the histograms
+//the last bucket takes whatever is left, so a bad rank cannot walk off the end of the histogram
+kernel void radix_select_pick(global const uint* hist, int shift, global uint* prefixes, global uint* remaining) {
+	int r = get_global_id(0);
+	global const uint* bucket = hist + r * SELECT_RADIX;
+	uint k = remaining[r];
+	uint digit = 0;
+	while (digit < SELECT_RADIX - 1 && k >= bucket[digit]) {
+		k -= bucket[digit];
+		digit++;
+	}
+	remaining[r] = k;
+	prefixes[r] |= digit << shift;
+}
@@ -0,0 +1,178 @@
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "DataLoader.h"
+
+using namespace std;
+
+//binary columnar cache of a parsed dataset, written next to the text file after the first parse
+//layout: CacheHeader, the station names (each a length byte followed by the characters), then the station,
+//packed timestamp and temperature columns, each starting on a 64 byte boundary so they can be used
+//straight from the mapping
+const char CACHE_MAGIC[8] = { 'T', 'E', 'M', 'P', 'C', 'O', 'L', 'S' };
+const uint32_t CACHE_VERSION = 2;
+const size_t CACHE_ALIGN = 64;
+
+enum CacheColumn {
+	CACHE_STATION,
+	CACHE_TIMESTAMP,
+	CACHE_TEMP,
+	CACHE_COLUMNS
+};
+
+//bytes per record in each column
+const size_t CACHE_WIDTHS[CACHE_COLUMNS] = { sizeof(uint8_t), sizeof(uint32_t), sizeof(float) };
+
+struct CacheHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t station_count;
+	uint64_t records;
+	//size and modification time of the text file the cache was built from
+	uint64_t source_size;
+	int64_t source_mtime;
+	uint64_t column_offset[CACHE_COLUMNS];
+};
+
+//reads the size and modification time of a file, returns false if it cannot be found
+bool fileStamp(const string& path, uint64_t& size, int64_t& mtime) {
+#ifdef _WIN32
+	struct _stat64 st;
+	if (_stat64(path.c_str(), &st) != 0)
+		return false;
+#else
+	struct stat st;
+	if (stat(path.c_str(), &st) != 0)
+		return false;
+#endif
+	size = (uint64_t)st.st_size;
+	mtime = (int64_t)st.st_mtime;
+	return true;
+}
+
+//works out where every column starts for a dataset of the given shape and returns the total file size
+uint64_t cacheLayout(uint64_t records, const vector<string>& stations, uint64_t offsets[CACHE_COLUMNS]) {
+	uint64_t pos = sizeof(CacheHeader);
+	for (const string& name : stations)
+		pos += 1 + name.size();
+	for (int c = 0; c < CACHE_COLUMNS; c++) {
+		pos = (pos + CACHE_ALIGN - 1) / CACHE_ALIGN * CACHE_ALIGN;
+		offsets[c] = pos;
+		pos += records * CACHE_WIDTHS[c];
+	}
+	return pos;
+}
+
+//writes the dataset to cache_path, stamped with the size and time of source_path
+//the file is written under a temporary name and renamed so a half written cache is never picked up
+bool writeCache(const string& cache_path, const string& source_path, const TempDataset& data) {
+	CacheHeader header = {};
+	memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+	header.version = CACHE_VERSION;
+	header.station_count = (uint32_t)data.stations.size();
+	header.records = data.size();
+	if (!fileStamp(source_path, header.source_size, header.source_mtime))
+		return false;
+	uint64_t total = cacheLayout(header.records, data.stations, header.column_offset);
+
+	const void* columns[CACHE_COLUMNS] = { data.station, data.timestamp, data.temp };
+	string temp_path = cache_path + ".tmp";
+	{
+		ofstream out(temp_path, ios::binary | ios::trunc);
+		if (!out)
+			return false;
+		out.write((const char*)&header, sizeof(header));
+		uint64_t written = sizeof(header);
+		for (const string& name : data.stations) {
+			char length = (char)name.size();
+			out.write(&length, 1);
+			out.write(name.data(), name.size());
+			written += 1 + name.size();
+		}
+		//zero the alignment gap in front of each column
+		const char zeros[CACHE_ALIGN] = {};
+		for (int c = 0; c < CACHE_COLUMNS; c++) {
+			uint64_t bytes = header.records * CACHE_WIDTHS[c];
+			out.write(zeros, header.column_offset[c] - written);
+			out.write((const char*)columns[c], bytes);
+			written = header.column_offset[c] + bytes;
+		}
+		if (!out || written != total)
+			return false;
+	}
+	std::remove(cache_path.c_str());
+	return std::rename(temp_path.c_str(), cache_path.c_str()) == 0;
+}
+
+//maps cache_path and points the dataset columns straight into the mapping
+//returns false if the cache is missing, damaged or older than source_path, in which case data is untouched
+bool openCache(const string& cache_path, const string& source_path, TempDataset& data) {
+	uint64_t source_size;
+	int64_t source_mtime;
+	if (!fileStamp(source_path, source_size, source_mtime))
+		return false;
+
+	unique_ptr<MappedFile> file;
+	try {
+		file.reset(new MappedFile(cache_path));
+	}
+	catch (const runtime_error&) {
+		return false;
+	}
+	if (file->size() < sizeof(CacheHeader))
+		return false;
+	CacheHeader header;
+	memcpy(&header, file->data(), sizeof(header));
+	if (memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 || header.version != CACHE_VERSION)
+		return false;
+	if (header.source_size != source_size || header.source_mtime != source_mtime)
+		return false;
+
+	//read the station dictionary, checking every name lies inside the file
+	vector<string> stations;
+	const char* pos = file->data() + sizeof(CacheHeader);
+	const char* end = file->data() + file->size();
+	for (uint32_t i = 0; i < header.station_count; i++) {
+		if (pos >= end || pos + 1 + (unsigned char)*pos > end)
+			return false;
+		stations.push_back(string(pos + 1, (unsigned char)*pos));
+		pos += 1 + (unsigned char)*pos;
+	}
+
+	uint64_t offsets[CACHE_COLUMNS];
+	uint64_t total = cacheLayout(header.records, stations, offsets);
+	if (total != file->size() || memcmp(offsets, header.column_offset, sizeof(offsets)) != 0)
+		return false;
+
+	const char* base = file->data();
+	TempDataset cached;
+	cached.records = header.records;
+	cached.stations = stations;
+	cached.station = (const uint8_t*)(base + offsets[CACHE_STATION]);
+	cached.timestamp = (const uint32_t*)(base + offsets[CACHE_TIMESTAMP]);
+	cached.temp = (const float*)(base + offsets[CACHE_TEMP]);
+	cached.mapped = move(file);
+	data = move(cached);
+	return true;
+}
+
+//loads the dataset from the binary cache beside path when it is up to date
+//otherwise parses the text file, with the temperatures going to temp_storage when it is given, and rewrites the cache for next time
+//a cached dataset always points into the cache mapping
+TempDataset loadDataCached(const string& path, bool& from_cache, const TempStorage& temp_storage = TempStorage()) {
+	string cache_path = path + ".cache";
+	TempDataset data;
+	from_cache = openCache(cache_path, path, data);
+	if (!from_cache) {
+		data = loadData(path, temp_storage);
+		if (!writeCache(cache_path, path, data))
+			cerr << "Warning: could not write dataset cache " << cache_path << endl;
+	}
+	return data;
+}
@@ -0,0 +1,416 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <stdexcept>
+#include <memory>
+#include <functional>
+#include <cstring>
+#include <stdint.h>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+//read only view of a whole file through the OS page cache
+//the mapping is released when the object goes out of scope
+class MappedFile {
+public:
+	explicit MappedFile(const string& path) : data_(nullptr), size_(0) {
+#ifdef _WIN32
+		file_ = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		mapping_ = NULL;
+		if (file_ == INVALID_HANDLE_VALUE)
+			throw runtime_error("could not open " + path);
+		LARGE_INTEGER file_size;
+		GetFileSizeEx(file_, &file_size);
+		size_ = (size_t)file_size.QuadPart;
+		//windows refuses to map empty files so leave data_ null
+		if (size_) {
+			mapping_ = CreateFileMappingA(file_, NULL, PAGE_READONLY, 0, 0, NULL);
+			if (mapping_ != NULL)
+				data_ = (const char*)MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0);
+			if (data_ == nullptr) {
+				close();
+				throw runtime_error("could not map " + path);
+			}
+		}
+#else
+		fd_ = open(path.c_str(), O_RDONLY);
+		if (fd_ < 0)
+			throw runtime_error("could not open " + path);
+		struct stat st;
+		fstat(fd_, &st);
+		size_ = (size_t)st.st_size;
+		if (size_) {
+			void* view = mmap(NULL, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+			if (view == MAP_FAILED) {
+				close();
+				throw runtime_error("could not map " + path);
+			}
+			data_ = (const char*)view;
+			//every page is going to be read by one of the parser threads
+			madvise(view, size_, MADV_WILLNEED);
+		}
+#endif
+	}
+
+	~MappedFile() { close(); }
+
+	const char* data() const { return data_; }
+	size_t size() const { return size_; }
+
+private:
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	void close() {
+#ifdef _WIN32
+		if (data_) UnmapViewOfFile(data_);
+		if (mapping_ != NULL) CloseHandle(mapping_);
+		if (file_ != INVALID_HANDLE_VALUE) CloseHandle(file_);
+		mapping_ = NULL;
+		file_ = INVALID_HANDLE_VALUE;
+#else
+		if (data_) munmap((void*)data_, size_);
+		if (fd_ >= 0) ::close(fd_);
+		fd_ = -1;
+#endif
+		data_ = nullptr;
+	}
+
+	const char* data_;
+	size_t size_;
+#ifdef _WIN32
+	HANDLE file_;
+	HANDLE mapping_;
+#else
+	int fd_;
+#endif
+};
+
+//runs task(0) ... task(count - 1) with one thread per task
+template <typename F>
+void runParallel(size_t count, F task) {
+	vector<thread> workers;
+	workers.reserve(count);
+	for (size_t i = 0; i < count; i++)
+		workers.emplace_back(task, i);
+	for (auto& worker : workers)
+		worker.join();
+}
+
+//number of worker threads to use, never less than one
+size_t hardwareThreads() {
+	size_t threads = thread::hardware_concurrency();
+	return threads ? threads : 1;
+}
+
+//splits [0, size) into at most chunks pieces which all start at the beginning of a line
+//returns the piece boundaries, so piece i is [bounds[i], bounds[i + 1])
+vector<size_t> splitChunks(const char* data, size_t size, size_t chunks) {
+	vector<size_t> bounds(1, 0);
+	for (size_t i = 1; i < chunks; i++) {
+		size_t pos = size / chunks * i;
+		if (pos <= bounds.back())
+			continue;
+		//move forward to the start of the next line
+		const char* nl = (const char*)memchr(data + pos, '\n', size - pos);
+		if (nl == nullptr)
+			break;
+		pos = (nl - data) + 1;
+		if (pos > bounds.back() && pos < size)
+			bounds.push_back(pos);
+	}
+	bounds.push_back(size);
+	return bounds;
+}
+
+inline bool isBlank(char c) {
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+//counts the lines in [begin, end) which hold at least one token
+size_t countRecords(const char* begin, const char* end) {
+	size_t records = 0;
+	while (begin < end) {
+		const char* nl = (const char*)memchr(begin, '\n', end - begin);
+		const char* line_end = nl ? nl : end;
+		for (const char* c = begin; c < line_end; c++) {
+			if (!isBlank(*c)) {
+				records++;
+				break;
+			}
+		}
+		begin = line_end + 1;
+	}
+	return records;
+}
+
+//parses a decimal number such as "-12.5" or "1e3" from [begin, end)
+//returns false if the text is not entirely a number
+bool parseFloat(const char* begin, const char* end, float& out) {
+	static const double powers[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+		1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+	const char* c = begin;
+	bool negative = false;
+	if (c < end && (*c == '-' || *c == '+'))
+		negative = (*c++ == '-');
+	//accumulate every digit into an integer mantissa and remember where the point was
+	uint64_t mantissa = 0;
+	int digits = 0;
+	int exponent = 0;
+	for (; c < end && *c >= '0' && *c <= '9'; c++, digits++) {
+		if (mantissa < 100000000000000000ULL)
+			mantissa = mantissa * 10 + (*c - '0');
+		else
+			exponent++;
+	}
+	if (c < end && *c == '.') {
+		for (c++; c < end && *c >= '0' && *c <= '9'; c++, digits++) {
+			if (mantissa < 100000000000000000ULL) {
+				mantissa = mantissa * 10 + (*c - '0');
+				exponent--;
+			}
+		}
+	}
+	if (digits == 0)
+		return false;
+	if (c < end && (*c == 'e' || *c == 'E')) {
+		c++;
+		bool negative_exp = false;
+		if (c < end && (*c == '-' || *c == '+'))
+			negative_exp = (*c++ == '-');
+		if (c == end)
+			return false;
+		int exp_val = 0;
+		for (; c < end && *c >= '0' && *c <= '9'; c++)
+			if (exp_val < 10000) exp_val = exp_val * 10 + (*c - '0');
+		exponent += negative_exp ? -exp_val : exp_val;
+	}
+	if (c != end)
+		return false;
+	double value = (double)mantissa;
+	while (exponent > 22) { value *= 1e22; exponent -= 22; }
+	while (exponent < -22) { value /= 1e22; exponent += 22; }
+	value = exponent < 0 ? value / powers[-exponent] : value * powers[exponent];
+	out = (float)(negative ? -value : value);
+	return true;
+}
+
+//parses an unsigned decimal integer from [begin, end)
+//returns false if the text is empty or holds anything but digits
+bool parseUInt(const char* begin, const char* end, uint32_t& out) {
+	if (begin == end)
+		return false;
+	uint32_t value = 0;
+	for (const char* c = begin; c < end; c++) {
+		if (*c < '0' || *c > '9')
+			return false;
+		value = value * 10 + (*c - '0');
+	}
+	out = value;
+	return true;
+}
+
+//moves begin past the next whitespace separated token in [begin, end) and returns where the token starts
+const char* nextToken(const char*& begin, const char* end) {
+	while (begin < end && isBlank(*begin))
+		begin++;
+	const char* token = begin;
+	while (begin < end && !isBlank(*begin))
+		begin++;
+	return token;
+}
+
+//date and time of a record packed into 32 bits, most significant field first so packed values sort
+//in time order: year (12 bits), month (4), day (5), hour (5), minute (6)
+inline uint32_t packTimestamp(uint32_t year, uint32_t month, uint32_t day, uint32_t hhmm) {
+	return (year << 20) | (month << 16) | (day << 11) | ((hhmm / 100) << 6) | (hhmm % 100);
+}
+
+inline uint32_t timestampYear(uint32_t ts) { return ts >> 20; }
+inline uint32_t timestampMonth(uint32_t ts) { return (ts >> 16) & 0xF; }
+inline uint32_t timestampDay(uint32_t ts) { return (ts >> 11) & 0x1F; }
+inline uint32_t timestampHHMM(uint32_t ts) { return ((ts >> 6) & 0x1F) * 100 + (ts & 0x3F); }
+
+//structure of arrays copy of the dataset with one entry per record in every column
+//station names are dictionary encoded as an index into stations and the date and time columns are
+//packed into one timestamp, so the three columns can be uploaded as uchar, uint and float buffers
+//the column pointers refer either to the vectors below or to a memory mapped cache file (see DataCache.h)
+struct TempDataset {
+	size_t records = 0;
+	vector<string> stations;
+
+	const uint8_t* station = nullptr;
+	const uint32_t* timestamp = nullptr;
+	const float* temp = nullptr;
+
+	vector<uint8_t> station_col;
+	vector<uint32_t> timestamp_col;
+	vector<float> temp_col;
+	unique_ptr<MappedFile> mapped;
+
+	TempDataset() = default;
+	TempDataset(TempDataset&&) = default;
+	TempDataset& operator=(TempDataset&&) = default;
+
+	size_t size() const { return records; }
+
+	//sizes the owned columns for n records and points the column pointers at them
+	//the temperatures go to temp_storage instead of temp_col when it is given
+	void allocate(size_t n, float* temp_storage = nullptr) {
+		records = n;
+		station_col.resize(n);
+		timestamp_col.resize(n);
+		if (!temp_storage)
+			temp_col.resize(n);
+		station = station_col.data();
+		timestamp = timestamp_col.data();
+		temp = temp_storage ? temp_storage : temp_col.data();
+	}
+};
+
+//hands the parser somewhere to write n temperatures, such as host memory shared with an OpenCL buffer
+typedef function<float*(size_t)> TempStorage;
+
+//station name, date and time of record i for reports, e.g. "SCAMPTON 01/08/1990 14:50"
+string describeRecord(const TempDataset& data, size_t i) {
+	auto twoDigits = [](uint32_t v) { return (v < 10 ? "0" : "") + to_string(v); };
+	uint32_t ts = data.timestamp[i];
+	uint32_t hhmm = timestampHHMM(ts);
+	return data.stations[data.station[i]] + " " + twoDigits(timestampDay(ts)) + "/" + twoDigits(timestampMonth(ts)) + "/" +
+		to_string(timestampYear(ts)) + " " + twoDigits(hhmm / 100) + ":" + twoDigits(hhmm % 100);
+}
+
+//parses every non-empty line of [begin, end) into the dataset columns starting at record first
+//station names are numbered in order of appearance in the dictionary names, local to this chunk
+//returns false on the first line that does not hold six valid fields or has an impossible date or time
+bool parseRecords(const char* begin, const char* end, TempDataset& data, size_t first, vector<string>& names) {
+	uint8_t* station = data.station_col.data() + first;
+	uint32_t* timestamp = data.timestamp_col.data() + first;
+	//the temperature column may live outside temp_col, see TempDataset::allocate
+	float* temp = (float*)data.temp + first;
+	//records are grouped by station so the previous id is almost always the right one
+	size_t last_id = 0;
+	while (begin < end) {
+		const char* nl = (const char*)memchr(begin, '\n', end - begin);
+		const char* line_end = nl ? nl : end;
+		const char* c = begin;
+		const char* name = nextToken(c, line_end);
+		size_t name_len = c - name;
+		begin = line_end + 1;
+		if (name_len == 0)
+			continue;
+
+		if (last_id >= names.size() || names[last_id].size() != name_len || memcmp(names[last_id].data(), name, name_len) != 0) {
+			for (last_id = 0; last_id < names.size(); last_id++) {
+				if (names[last_id].size() == name_len && memcmp(names[last_id].data(), name, name_len) == 0)
+					break;
+			}
+			if (last_id == names.size()) {
+				if (names.size() > UINT8_MAX)
+					return false;
+				names.push_back(string(name, name_len));
+			}
+		}
+
+		//year, month, day and HHMM
+		uint32_t fields[4];
+		for (int f = 0; f < 4; f++) {
+			const char* token = nextToken(c, line_end);
+			if (!parseUInt(token, c, fields[f]))
+				return false;
+		}
+		if (fields[0] > 4095 || fields[1] < 1 || fields[1] > 12 || fields[2] < 1 || fields[2] > 31 || fields[3] / 100 > 23 || fields[3] % 100 > 59)
+			return false;
+		const char* token = nextToken(c, line_end);
+		if (!parseFloat(token, c, *temp))
+			return false;
+		const char* rest = nextToken(c, line_end);
+		if (rest != c)
+			return false;
+
+		*station++ = (uint8_t)last_id;
+		*timestamp++ = packTimestamp(fields[0], fields[1], fields[2], fields[3]);
+		temp++;
+	}
+	return true;
+}
+
+//parses the text of size bytes at data, which must start at the beginning of a line, into a new dataset
+//splits the text into line aligned chunks and parses every chunk on its own thread; the first pass counts
+//records so each thread can write straight into its slice of the columns
+//path is only used to name the file in errors, temp_storage optionally provides the temperature column
+TempDataset parseText(const char* data, size_t size, const string& path, const TempStorage& temp_storage = TempStorage()) {
+	//give each thread at least 1MB so small files are not split into pointless slivers
+	size_t chunks = size / (1 << 20) + 1;
+	if (chunks > hardwareThreads())
+		chunks = hardwareThreads();
+	vector<size_t> bounds = splitChunks(data, size, chunks);
+	chunks = bounds.size() - 1;
+
+	//count records in every chunk then turn the counts into output offsets
+	vector<size_t> offsets(chunks + 1, 0);
+	runParallel(chunks, [&](size_t i) {
+		offsets[i + 1] = countRecords(data + bounds[i], data + bounds[i + 1]);
+	});
+	for (size_t i = 0; i < chunks; i++)
+		offsets[i + 1] += offsets[i];
+
+	TempDataset dataset;
+	dataset.allocate(offsets[chunks], temp_storage ? temp_storage(offsets[chunks]) : nullptr);
+	vector<vector<string>> names(chunks);
+	vector<char> ok(chunks, 1);
+	runParallel(chunks, [&](size_t i) {
+		ok[i] = parseRecords(data + bounds[i], data + bounds[i + 1], dataset, offsets[i], names[i]);
+	});
+	for (size_t i = 0; i < chunks; i++) {
+		if (!ok[i])
+			throw runtime_error("malformed record in " + path);
+	}
+
+	//merge the per chunk station dictionaries and renumber any chunk whose ids differ
+	for (size_t i = 0; i < chunks; i++) {
+		uint8_t remap[UINT8_MAX + 1];
+		bool identity = true;
+		for (size_t local = 0; local < names[i].size(); local++) {
+			size_t global = 0;
+			while (global < dataset.stations.size() && dataset.stations[global] != names[i][local])
+				global++;
+			if (global == dataset.stations.size()) {
+				if (global > UINT8_MAX)
+					throw runtime_error("too many stations in " + path);
+				dataset.stations.push_back(names[i][local]);
+			}
+			remap[local] = (uint8_t)global;
+			identity = identity && (global == local);
+		}
+		if (!identity) {
+			for (size_t r = offsets[i]; r < offsets[i + 1]; r++)
+				dataset.station_col[r] = remap[dataset.station_col[r]];
+		}
+	}
+	return dataset;
+}
+
+//function to load data from provided path
+//maps the file into memory and parses all of it in parallel
+TempDataset loadData(const string& path, const TempStorage& temp_storage = TempStorage()) {
+	MappedFile file(path);
+	return parseText(file.data(), file.size(), path, temp_storage);
+}
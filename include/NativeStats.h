@@ -0,0 +1,373 @@
+#pragma once
+
+#include <vector>
+#include <queue>
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <cmath>
+#include <cstring>
+#include <stdint.h>
+#include "DataLoader.h"
+#include "StatsAccumulator.h"
+
+//x86 builds compile AVX2 and AVX-512 versions of the inner loops next to the scalar ones and pick one at run time,
+//so the same executable uses the widest instructions the CPU and OS support without needing /arch or -m flags
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define NATIVE_X86
+#ifdef _MSC_VER
+#include <intrin.h>
+#define NATIVE_TARGET(isa)
+#else
+#include <immintrin.h>
+#define NATIVE_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
+using namespace std;
+
+//native CPU backend for the statistics, sort and quartiles, one thread per core over a slice of the temperatures each
+
+//values summed in float lanes before the block total is added to a double, keeps the lane sums accurate on long slices
+const size_t NATIVE_BLOCK = 4096;
+
+//instruction sets the native loops can run with, widest last
+enum NativeSimd {
+	NATIVE_SCALAR,
+	NATIVE_AVX2,
+	NATIVE_AVX512
+};
+
+//widest instruction set both the CPU and the operating system support, the OS has to save the wider registers
+NativeSimd detectNativeSimd() {
+#ifdef NATIVE_X86
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return NATIVE_SCALAR;
+	__cpuid(info, 1);
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx = (info[2] & (1 << 28)) != 0;
+	if (!osxsave || !avx)
+		return NATIVE_SCALAR;
+	unsigned long long xcr0 = _xgetbv(0);
+	__cpuidex(info, 7, 0);
+	//xcr0 bits 1 and 2 are the SSE and AVX state, 5 to 7 the AVX-512 mask and upper registers
+	if ((info[1] & (1 << 16)) && (xcr0 & 0xE6) == 0xE6)
+		return NATIVE_AVX512;
+	if ((info[1] & (1 << 5)) && (xcr0 & 0x6) == 0x6)
+		return NATIVE_AVX2;
+#else
+	//the compiler's checks include the operating system support
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+		return NATIVE_AVX512;
+	if (__builtin_cpu_supports("avx2"))
+		return NATIVE_AVX2;
+#endif
+#endif
+	return NATIVE_SCALAR;
+}
+
+//instruction set of this CPU, detected once
+NativeSimd nativeSimd() {
+	static const NativeSimd simd = detectNativeSimd();
+	return simd;
+}
+
+//name of the instruction set the native loops run with
+string nativeSimdName() {
+	switch (nativeSimd()) {
+	case NATIVE_AVX512:
+		return "AVX-512";
+	case NATIVE_AVX2:
+		return "AVX2";
+	default:
+		return "scalar";
+	}
+}
+
+//sum, min and max of the values from a + i to a + n, the sum in float so n should be at most NATIVE_BLOCK
+void nativeSumMinMaxScalar(const float* a, size_t i, size_t n, float& sum, float& lo, float& hi) {
+	for (; i < n; i++) {
+		sum += a[i];
+		lo = min(lo, a[i]);
+		hi = max(hi, a[i]);
+	}
+}
+
+//sum of the squared differences from mean of the values from a + i to a + n, in float so n should be at most NATIVE_BLOCK
+float nativeSquaredDiffsScalar(const float* a, size_t i, size_t n, float mean) {
+	float sum = 0.0f;
+	for (; i < n; i++) {
+		float d = a[i] - mean;
+		sum += d * d;
+	}
+	return sum;
+}
+
+#ifdef NATIVE_X86
+NATIVE_TARGET("avx2")
+void nativeSumMinMaxAvx2(const float* a, size_t n, float& sum, float& lo, float& hi) {
+	size_t i = 0;
+	__m256 vsum = _mm256_setzero_ps();
+	__m256 vlo = _mm256_set1_ps(lo);
+	__m256 vhi = _mm256_set1_ps(hi);
+	for (; i + 8 <= n; i += 8) {
+		__m256 x = _mm256_loadu_ps(a + i);
+		vsum = _mm256_add_ps(vsum, x);
+		vlo = _mm256_min_ps(vlo, x);
+		vhi = _mm256_max_ps(vhi, x);
+	}
+	float lanes[3][8];
+	_mm256_storeu_ps(lanes[0], vsum);
+	_mm256_storeu_ps(lanes[1], vlo);
+	_mm256_storeu_ps(lanes[2], vhi);
+	for (int l = 0; l < 8; l++) {
+		sum += lanes[0][l];
+		lo = min(lo, lanes[1][l]);
+		hi = max(hi, lanes[2][l]);
+	}
+	nativeSumMinMaxScalar(a, i, n, sum, lo, hi);
+}
+
+NATIVE_TARGET("avx2")
+float nativeSquaredDiffsAvx2(const float* a, size_t n, float mean) {
+	size_t i = 0;
+	__m256 vsum = _mm256_setzero_ps();
+	__m256 vmean = _mm256_set1_ps(mean);
+	for (; i + 8 <= n; i += 8) {
+		__m256 d = _mm256_sub_ps(_mm256_loadu_ps(a + i), vmean);
+		vsum = _mm256_add_ps(vsum, _mm256_mul_ps(d, d));
+	}
+	float lanes[8];
+	_mm256_storeu_ps(lanes, vsum);
+	float sum = 0.0f;
+	for (int l = 0; l < 8; l++)
+		sum += lanes[l];
+	return sum + nativeSquaredDiffsScalar(a, i, n, mean);
+}
+
+NATIVE_TARGET("avx512f")
+void nativeSumMinMaxAvx512(const float* a, size_t n, float& sum, float& lo, float& hi) {
+	size_t i = 0;
+	__m512 vsum = _mm512_setzero_ps();
+	__m512 vlo = _mm512_set1_ps(lo);
+	__m512 vhi = _mm512_set1_ps(hi);
+	for (; i + 16 <= n; i += 16) {
+		__m512 x = _mm512_loadu_ps(a + i);
+		vsum = _mm512_add_ps(vsum, x);
+		//the masked forms with every lane set, the plain ones trip GCC's uninitialised warnings in its own header
+		vlo = _mm512_mask_min_ps(vlo, 0xFFFF, vlo, x);
+		vhi = _mm512_mask_max_ps(vhi, 0xFFFF, vhi, x);
+	}
+	float lanes[3][16];
+	_mm512_storeu_ps(lanes[0], vsum);
+	_mm512_storeu_ps(lanes[1], vlo);
+	_mm512_storeu_ps(lanes[2], vhi);
+	for (int l = 0; l < 16; l++) {
+		sum += lanes[0][l];
+		lo = min(lo, lanes[1][l]);
+		hi = max(hi, lanes[2][l]);
+	}
+	nativeSumMinMaxScalar(a, i, n, sum, lo, hi);
+}
+
+NATIVE_TARGET("avx512f")
+float nativeSquaredDiffsAvx512(const float* a, size_t n, float mean) {
+	size_t i = 0;
+	__m512 vsum = _mm512_setzero_ps();
+	__m512 vmean = _mm512_set1_ps(mean);
+	for (; i + 16 <= n; i += 16) {
+		__m512 d = _mm512_sub_ps(_mm512_loadu_ps(a + i), vmean);
+		vsum = _mm512_add_ps(vsum, _mm512_mul_ps(d, d));
+	}
+	float lanes[16];
+	_mm512_storeu_ps(lanes, vsum);
+	float sum = 0.0f;
+	for (int l = 0; l < 16; l++)
+		sum += lanes[l];
+	return sum + nativeSquaredDiffsScalar(a, i, n, mean);
+}
+#endif
+
+//sum, min and max of n values with the widest instructions available, n should be at most NATIVE_BLOCK
+void nativeSumMinMax(const float* a, size_t n, float& sum, float& lo, float& hi) {
+	sum = 0.0f;
+#ifdef NATIVE_X86
+	if (nativeSimd() == NATIVE_AVX512)
+		return nativeSumMinMaxAvx512(a, n, sum, lo, hi);
+	if (nativeSimd() == NATIVE_AVX2)
+		return nativeSumMinMaxAvx2(a, n, sum, lo, hi);
+#endif
+	nativeSumMinMaxScalar(a, 0, n, sum, lo, hi);
+}
+
+//sum of the squared differences of n values from mean with the widest instructions available
+float nativeSquaredDiffs(const float* a, size_t n, float mean) {
+#ifdef NATIVE_X86
+	if (nativeSimd() == NATIVE_AVX512)
+		return nativeSquaredDiffsAvx512(a, n, mean);
+	if (nativeSimd() == NATIVE_AVX2)
+		return nativeSquaredDiffsAvx2(a, n, mean);
+#endif
+	return nativeSquaredDiffsScalar(a, 0, n, mean);
+}
+
+//statistics of the n values starting at record first, in two passes: the sum, min and max, then the squared
+//differences from the slice mean; the records of the min and max are the first holding each value
+StatsAccumulator nativeSlice(const float* a, size_t n, size_t first) {
+	StatsAccumulator p;
+	if (n == 0)
+		return p;
+	double sum = 0.0;
+	for (size_t i = 0; i < n; i += NATIVE_BLOCK) {
+		float block_sum;
+		nativeSumMinMax(a + i, min(NATIVE_BLOCK, n - i), block_sum, p.min, p.max);
+		sum += block_sum;
+	}
+	p.count = (double)n;
+	p.mean = sum / n;
+	for (size_t i = 0; i < n; i += NATIVE_BLOCK)
+		p.m2 += nativeSquaredDiffs(a + i, min(NATIVE_BLOCK, n - i), (float)p.mean);
+	p.min_index = first + (find(a, a + n, p.min) - a);
+	p.max_index = first + (find(a, a + n, p.max) - a);
+	return p;
+}
+
+//mean, variance, min and max of n temperatures with one slice per thread
+StatsAccumulator nativeStats(const float* temps, size_t n) {
+	size_t threads = max(min(hardwareThreads(), n / NATIVE_BLOCK), (size_t)1);
+	vector<StatsAccumulator> partials(threads);
+	runParallel(threads, [&](size_t t) {
+		size_t first = n * t / threads;
+		size_t last = n * (t + 1) / threads;
+		partials[t] = nativeSlice(temps + first, last - first, first);
+	});
+	StatsAccumulator total;
+	for (const StatsAccumulator& p : partials)
+		total.add(p);
+	return total;
+}
+
+//merges the sorted runs into one sorted list on the CPU with one thread per core
+//samples of the runs pick a pivot per thread, each thread then merges the values of every run between its pivots
+//with a heap, writing from the position given by how many values of all the runs fall below its first pivot
+vector<float> mergeRuns(const vector<vector<float>>& runs, size_t n) {
+	size_t threads = hardwareThreads();
+	vector<float> samples;
+	for (const vector<float>& run : runs)
+		for (size_t s = 0; s < threads && !run.empty(); s++)
+			samples.push_back(run[run.size() * s / threads]);
+	sort(samples.begin(), samples.end());
+	vector<float> pivots;
+	for (size_t t = 1; t < threads && !samples.empty(); t++)
+		pivots.push_back(samples[samples.size() * t / threads]);
+	threads = pivots.size() + 1;
+
+	//where each thread starts in every run, the last bound of every run is its end
+	vector<vector<size_t>> bounds(threads + 1, vector<size_t>(runs.size()));
+	for (size_t r = 0; r < runs.size(); r++) {
+		for (size_t t = 1; t < threads; t++)
+			bounds[t][r] = lower_bound(runs[r].begin(), runs[r].end(), pivots[t - 1]) - runs[r].begin();
+		bounds[threads][r] = runs[r].size();
+	}
+
+	vector<float> merged(n);
+	runParallel(threads, [&](size_t t) {
+		size_t out = 0;
+		for (size_t r = 0; r < runs.size(); r++)
+			out += bounds[t][r];
+		//smallest unmerged value of every run at the top
+		typedef pair<float, size_t> Head;
+		priority_queue<Head, vector<Head>, greater<Head>> heads;
+		vector<size_t> pos = bounds[t];
+		for (size_t r = 0; r < runs.size(); r++)
+			if (pos[r] < bounds[t + 1][r])
+				heads.push(Head(runs[r][pos[r]], r));
+		while (!heads.empty()) {
+			size_t r = heads.top().second;
+			heads.pop();
+			merged[out++] = runs[r][pos[r]++];
+			if (pos[r] < bounds[t + 1][r])
+				heads.push(Head(runs[r][pos[r]], r));
+		}
+	});
+	return merged;
+}
+
+//sorts n temperatures by sorting one run per thread and merging the runs
+vector<float> nativeSort(const float* temps, size_t n) {
+	size_t threads = max(min(hardwareThreads(), n / NATIVE_BLOCK), (size_t)1);
+	vector<vector<float>> runs(threads);
+	runParallel(threads, [&](size_t t) {
+		runs[t].assign(temps + n * t / threads, temps + n * (t + 1) / threads);
+		sort(runs[t].begin(), runs[t].end());
+	});
+	return mergeRuns(runs, n);
+}
+
+//digit width of the native radix select passes, as SELECT_BITS in my_kernels.cl
+const int NATIVE_SELECT_BITS = 8;
+
+//unsigned key that sorts as the float does, as float_key in my_kernels.cl
+uint32_t nativeKey(float value) {
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	return bits ^ ((bits >> 31) ? 0xFFFFFFFF : 0x80000000);
+}
+
+//inverse of nativeKey
+float nativeKeyValue(uint32_t key) {
+	uint32_t bits = key ^ ((key >> 31) ? 0x80000000 : 0xFFFFFFFF);
+	float value;
+	memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+//values at the given ranks of the sorted temperatures without sorting them, with the radix select of the device
+//each pass every thread histograms the next NATIVE_SELECT_BITS of the keys of its slice that match each rank's
+//prefix, then the histograms of all the threads added up give the bucket holding each rank and the next digit of its
+//prefix; after 32 / NATIVE_SELECT_BITS passes every prefix is the exact key
+vector<float> nativeSelect(const float* temps, size_t n, const vector<size_t>& ranks) {
+	size_t count = ranks.size();
+	size_t digits = (size_t)1 << NATIVE_SELECT_BITS;
+	size_t threads = max(min(hardwareThreads(), n / NATIVE_BLOCK), (size_t)1);
+	vector<uint32_t> prefixes(count, 0);
+	vector<size_t> remaining(ranks);
+	vector<vector<size_t>> hists(threads, vector<size_t>(count * digits));
+	for (int shift = 32 - NATIVE_SELECT_BITS; shift >= 0; shift -= NATIVE_SELECT_BITS) {
+		uint32_t mask = shift + NATIVE_SELECT_BITS < 32 ? 0xFFFFFFFF << (shift + NATIVE_SELECT_BITS) : 0;
+		runParallel(threads, [&](size_t t) {
+			vector<size_t>& hist = hists[t];
+			fill(hist.begin(), hist.end(), (size_t)0);
+			for (size_t i = n * t / threads; i < n * (t + 1) / threads; i++) {
+				uint32_t key = nativeKey(temps[i]);
+				size_t digit = (key >> shift) & (digits - 1);
+				for (size_t r = 0; r < count; r++)
+					if ((key & mask) == prefixes[r])
+						hist[r * digits + digit]++;
+			}
+		});
+
+		//walk the added up histograms to the bucket holding each rank, the last bucket takes whatever is left
+		for (size_t r = 0; r < count; r++) {
+			uint32_t digit = 0;
+			for (; digit + 1 < digits; digit++) {
+				size_t bucket = 0;
+				for (size_t t = 0; t < threads; t++)
+					bucket += hists[t][r * digits + digit];
+				if (remaining[r] < bucket)
+					break;
+				remaining[r] -= bucket;
+			}
+			prefixes[r] |= digit << shift;
+		}
+	}
+
+	vector<float> selected(count);
+	for (size_t r = 0; r < count; r++)
+		selected[r] = nativeKeyValue(prefixes[r]);
+	return selected;
+}
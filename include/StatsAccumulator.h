@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cmath>
+#include <limits>
+#include <stddef.h>
+
+using namespace std;
+
+//summary statistics produced by every statistics path
+//the moments stay in double precision so the -f sums are not rounded to float on the way out
+struct Stats {
+	double mean;
+	float min;
+	float max;
+	double variance;
+	double standard_deviation;
+	//records holding the min and max, the earliest one when several share the value
+	size_t min_index;
+	size_t max_index;
+};
+
+//running merge of partial statistics in double precision using Chan's parallel update
+//a partial is anything with count, mean, m2 (the sum of squared differences from its mean), min, max and their
+//indices: a stats_fused work group, a slice of the native backend or another accumulator
+//record indices are offset by the base passed with each partial so partials of several chunks, runs or devices can be merged
+struct StatsAccumulator {
+	double count = 0.0;
+	double mean = 0.0;
+	double m2 = 0.0;
+	float min = numeric_limits<float>::infinity();
+	float max = -numeric_limits<float>::infinity();
+	size_t min_index = numeric_limits<size_t>::max();
+	size_t max_index = numeric_limits<size_t>::max();
+
+	//merges n values with mean p_mean and sum of squared differences p_m2
+	void addMoments(double n, double p_mean, double p_m2) {
+		if (n == 0.0)
+			return;
+		double total = count + n;
+		double delta = p_mean - mean;
+		mean += delta * n / total;
+		m2 += p_m2 + delta * delta * count * n / total;
+		count = total;
+	}
+
+	//keeps value as the min if it is smaller, ties go to the earlier record as on the device
+	void addMin(float value, size_t index) {
+		if (value < min || (value == min && index < min_index)) {
+			min = value;
+			min_index = index;
+		}
+	}
+
+	//keeps value as the max if it is larger, ties go to the earlier record
+	void addMax(float value, size_t index) {
+		if (value > max || (value == max && index < max_index)) {
+			max = value;
+			max_index = index;
+		}
+	}
+
+	//merges a partial whose records start at base, skipping empty ones
+	template<typename P>
+	void add(const P& p, size_t base = 0) {
+		if (p.count == 0)
+			return;
+		addMoments((double)p.count, p.mean, p.m2);
+		addMin(p.min, base + p.min_index);
+		addMax(p.max, base + p.max_index);
+	}
+
+	Stats result() const {
+		Stats stats;
+		stats.mean = mean;
+		stats.min = min;
+		stats.max = max;
+		stats.min_index = min_index;
+		stats.max_index = max_index;
+		stats.variance = m2 / count;
+		stats.standard_deviation = sqrt(m2 / count);
+		return stats;
+	}
+};
@@ -4,6 +4,9 @@
 #include <vector>
 #include <iostream>
 #include <sstream>
+#include <cstdio>
+#include <cstring>
+#include <stdint.h>
 
 #define CL_USE_DEPRECATED_OPENCL_1_2_APIS
 #define CL_HPP_MINIMUM_OPENCL_VERSION 120
@@ -199,6 +202,129 @@ cl::Context GetContext(int platform_id, int device_id) {
 	return cl::Context();
 }
 
+//one context per platform holding every device of that platform, for the platform platform_id or all of them when it is negative
+//devices of different platforms cannot share a context, so each platform gets its own
+vector<cl::Context> GetPlatformContexts(int platform_id) {
+	vector<cl::Platform> platforms;
+	cl::Platform::get(&platforms);
+
+	vector<cl::Context> contexts;
+	for (unsigned int i = 0; i < platforms.size(); i++) {
+		if (platform_id >= 0 && i != platform_id)
+			continue;
+		vector<cl::Device> devices;
+		platforms[i].getDevices((cl_device_type)CL_DEVICE_TYPE_ALL, &devices);
+		if (!devices.empty())
+			contexts.push_back(cl::Context(devices));
+	}
+	return contexts;
+}
+
+//context holding one sub-device of the device per NUMA node, from partitioning it by the NUMA affinity domain
+//devices that cannot be split by NUMA node, such as most GPUs, come back whole in a context of their own; other
+//domains are not tried as they can split per cache, so per core, rather than per memory node
+//partitioned is set to whether the device was split
+cl::Context GetNumaContext(int platform_id, int device_id, bool& partitioned) {
+	cl::Context context = GetContext(platform_id, device_id);
+	cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+	const cl_device_partition_property properties[] = { CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN, CL_DEVICE_AFFINITY_DOMAIN_NUMA, 0 };
+	vector<cl::Device> sub_devices;
+	try {
+		device.createSubDevices(properties, &sub_devices);
+	}
+	catch (const cl::Error&) {
+		sub_devices.clear();
+	}
+	partitioned = !sub_devices.empty();
+	if (partitioned)
+		return cl::Context(sub_devices);
+	cerr << "Warning: " << device.getInfo<CL_DEVICE_NAME>() << " cannot be partitioned by NUMA node, using it whole" << endl;
+	return context;
+}
+
+//64 bit FNV-1a hash of text, continuing from hash so several strings can be combined
+uint64_t HashText(const string& text, uint64_t hash = 14695981039346656037ULL) {
+	for (unsigned char c : text) {
+		hash ^= c;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+//builds the program in file_name for device of context, reusing the compiled binary from an earlier run when it can
+//binaries are stored next to the source, named by a hash of the source, build options, platform, device and driver
+//version, so any change to those builds from source again; a binary that fails to load or build is rebuilt and replaced
+//returns true if the binary was reused, build errors from the source leave program set so the build log can be read
+bool BuildProgramCached(const cl::Context& context, const cl::Device& device, const string& file_name, const string& options, cl::Program& program) {
+	const char magic[8] = { 'C', 'L', 'B', 'I', 'N', 'A', 'R', 'Y' };
+	ifstream source_file(file_name, ios::binary);
+	string source((istreambuf_iterator<char>(source_file)), istreambuf_iterator<char>());
+	cl::Platform platform(device.getInfo<CL_DEVICE_PLATFORM>());
+
+	uint64_t key = HashText(source);
+	for (const string& part : { options, platform.getInfo<CL_PLATFORM_NAME>(), platform.getInfo<CL_PLATFORM_VERSION>(),
+		device.getInfo<CL_DEVICE_NAME>(), device.getInfo<CL_DEVICE_VERSION>(), device.getInfo<CL_DRIVER_VERSION>() })
+		key = HashText(part, HashText(string(1, '\0'), key));
+	stringstream name;
+	name << file_name << "." << hex << key << ".bin";
+	string cache_path = name.str();
+
+	//file layout: magic, key, then the binary
+	ifstream cached(cache_path, ios::binary);
+	if (cached) {
+		char file_magic[8];
+		uint64_t file_key = 0;
+		cached.read(file_magic, sizeof(file_magic));
+		cached.read((char*)&file_key, sizeof(file_key));
+		vector<unsigned char> binary((istreambuf_iterator<char>(cached)), istreambuf_iterator<char>());
+		if (memcmp(file_magic, magic, sizeof(magic)) == 0 && file_key == key && !binary.empty()) {
+			try {
+				program = cl::Program(context, { device }, cl::Program::Binaries(1, binary));
+				program.build({ device }, options.c_str());
+				return true;
+			}
+			catch (const cl::Error&) {
+				cerr << "Warning: could not load kernel binary " << cache_path << ", rebuilding" << endl;
+			}
+		}
+	}
+
+	program = cl::Program(context, source);
+	program.build({ device }, options.c_str());
+
+	//write under a temporary name and rename so a half written binary is never picked up
+	//binaries come back in the order of the program's devices, with an empty one for each it was not built for
+	vector<vector<unsigned char>> binaries = program.getInfo<CL_PROGRAM_BINARIES>();
+	vector<cl::Device> program_devices = program.getInfo<CL_PROGRAM_DEVICES>();
+	size_t index = 0;
+	while (index + 1 < program_devices.size() && program_devices[index]() != device())
+		index++;
+	if (index < binaries.size() && !binaries[index].empty()) {
+		string temp_path = cache_path + ".tmp";
+		{
+			ofstream out(temp_path, ios::binary | ios::trunc);
+			out.write(magic, sizeof(magic));
+			out.write((const char*)&key, sizeof(key));
+			out.write((const char*)binaries[index].data(), binaries[index].size());
+		}
+		std::remove(cache_path.c_str());
+		if (std::rename(temp_path.c_str(), cache_path.c_str()) != 0)
+			cerr << "Warning: could not write kernel binary " << cache_path << endl;
+	}
+	return false;
+}
+
+//builds the program in file_name for the first device of context, see above
+bool BuildProgramCached(const cl::Context& context, const string& file_name, const string& options, cl::Program& program) {
+	return BuildProgramCached(context, context.getInfo<CL_CONTEXT_DEVICES>()[0], file_name, options, program);
+}
+
+//true when the device works on host memory directly, as integrated GPUs and CPU runtimes do,
+//so buffers allocated in host memory can be used by both sides without any transfers
+bool SharesHostMemory(const cl::Device& device) {
+	return device.getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>() == CL_TRUE || (device.getInfo<CL_DEVICE_TYPE>() & CL_DEVICE_TYPE_CPU) != 0;
+}
+
 enum ProfilingResolution {
 	PROF_NS = 1,
 	PROF_US = 1000,